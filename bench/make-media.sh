@@ -0,0 +1,91 @@
+#!/bin/bash
+# Generate a reproducible set of test media for benchmarking phash-compare
+# end to end: videos with long-tailed durations and images, each with a
+# few near-duplicates (re-encoded, rescaled, trimmed) so the comparison
+# finds real matches.
+#
+# Usage: bench/make-media.sh [-v videos] [-i images] [-d dup_percent] [-s seed] directory
+#
+# Then, for example:
+#   ./build/phash-compare -j 8 -v -r directory -t mp4 -s videos.db -w -d 40 --stats > /dev/null
+#   ./build/phash-compare -j 8 -i -r directory -t jpg -t png -s images.db -w -d 10 --stats > /dev/null
+
+set -e
+
+videos=20
+images=200
+dup_percent=10
+seed=1
+
+while getopts "v:i:d:s:h" opt; do
+    case $opt in
+        v) videos=$OPTARG ;;
+        i) images=$OPTARG ;;
+        d) dup_percent=$OPTARG ;;
+        s) seed=$OPTARG ;;
+        *)
+            echo "Usage: $0 [-v videos] [-i images] [-d dup_percent] [-s seed] directory"
+            exit 1
+            ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+if [ $# -ne 1 ]; then
+    echo "Usage: $0 [-v videos] [-i images] [-d dup_percent] [-s seed] directory"
+    exit 1
+fi
+out=$1
+
+if ! command -v ffmpeg &> /dev/null; then
+    echo "Error: ffmpeg not found. Please install ffmpeg first."
+    exit 1
+fi
+
+mkdir -p "$out/video" "$out/image"
+RANDOM=$seed
+
+# The lavfi test sources differ in content, so unrelated files do not match
+sources=(testsrc testsrc2 smptebars rgbtestsrc mandelbrot life cellauto)
+ff() {
+    ffmpeg -nostdin -hide_banner -loglevel error -y "$@"
+}
+
+# Durations from about 5 seconds to 10 minutes, most of them short
+duration() {
+    local r=$((RANDOM % 100))
+    if [ $r -lt 60 ]; then
+        echo $((5 + RANDOM % 55))
+    elif [ $r -lt 90 ]; then
+        echo $((60 + RANDOM % 180))
+    else
+        echo $((240 + RANDOM % 360))
+    fi
+}
+
+echo "Generating $videos videos in $out/video..."
+for ((n = 0; n < videos; n++)); do
+    name=$(printf "%s/video/clip_%05d.mp4" "$out" $n)
+    src=${sources[$((RANDOM % ${#sources[@]}))]}
+    len=$(duration)
+    ff -f lavfi -i "$src=size=640x360:rate=25,hue=h=$((RANDOM % 360))" -t "$len" \
+        -c:v libx264 -preset ultrafast -pix_fmt yuv420p "$name"
+    if [ $((RANDOM % 100)) -lt "$dup_percent" ]; then
+        # Lower quality re-encode at a smaller size, and a trimmed copy
+        ff -i "$name" -vf scale=426:240 -c:v libx264 -preset ultrafast -crf 35 "${name%.mp4}_small.mp4"
+        ff -i "$name" -ss 2 -c:v libx264 -preset ultrafast "${name%.mp4}_trim.mp4"
+    fi
+done
+
+echo "Generating $images images in $out/image..."
+for ((n = 0; n < images; n++)); do
+    name=$(printf "%s/image/photo_%05d" "$out" $n)
+    src=${sources[$((RANDOM % ${#sources[@]}))]}
+    ff -f lavfi -i "$src=size=1920x1080,hue=h=$((RANDOM % 360))" -ss "$((RANDOM % 30))" -frames:v 1 "$name.jpg"
+    if [ $((RANDOM % 100)) -lt "$dup_percent" ]; then
+        ff -i "$name.jpg" -vf scale=960:540 -q:v 20 "${name}_small.jpg"
+        ff -i "$name.jpg" "${name}_copy.png"
+    fi
+done
+
+echo "Done: $(find "$out" -type f | wc -l) files in $out"
@@ -0,0 +1,562 @@
+// Benchmarks for the hot paths of phash-compare: Hamming distance, hex
+// encoding, database save/load and the all-pairs comparison. Everything
+// runs on synthetic hash sets generated from a seed, so results can be
+// compared between builds and machines without any media. --images is the
+// exception: it checks scaled image decoding against pHash on real files.
+//
+// Build with -DPHASH_COMPARE_BENCHMARKS=ON, then run `make benchmark` or
+// phash-compare-bench directly (see -h).
+#define PHASH_COMPARE_NO_MAIN
+#include "../phash-compare.cpp"
+
+#include <cmath>
+#include <random>
+
+// Number of hash blocks per synthetic entry: "N" for a fixed length (1 is
+// an image hash), "MIN-MAX" for uniform lengths, or
+// "lognormal:MEDIAN:SIGMA" for the long-tailed lengths of a video library
+struct LengthDistribution {
+    enum class Kind { Fixed, Uniform, LogNormal } kind = Kind::Fixed;
+    double a = 1;
+    double b = 1;
+
+    bool parse(const std::string& spec) {
+        try {
+            if (spec.compare(0, 10, "lognormal:") == 0) {
+                size_t colon = spec.find(':', 10);
+                if (colon == std::string::npos) return false;
+                kind = Kind::LogNormal;
+                a = std::stod(spec.substr(10, colon - 10));
+                b = std::stod(spec.substr(colon + 1));
+                return a >= 1 && b >= 0;
+            }
+            size_t dash = spec.find('-');
+            if (dash != std::string::npos) {
+                kind = Kind::Uniform;
+                a = std::stoi(spec.substr(0, dash));
+                b = std::stoi(spec.substr(dash + 1));
+                return a >= 1 && b >= a;
+            }
+            kind = Kind::Fixed;
+            a = b = std::stoi(spec);
+            return a >= 1;
+        } catch (const std::exception&) {
+            return false;
+        }
+    }
+
+    int sample(std::mt19937_64& rng) const {
+        double length = a;
+        if (kind == Kind::Uniform) {
+            length = std::uniform_int_distribution<int>(static_cast<int>(a), static_cast<int>(b))(rng);
+        } else if (kind == Kind::LogNormal) {
+            length = std::round(std::lognormal_distribution<double>(std::log(a), b)(rng));
+        }
+        return static_cast<int>(std::min(std::max(length, 1.0), 4096.0));
+    }
+};
+
+struct BenchConfig {
+    size_t entries = 20000;
+    LengthDistribution lengths;
+    int threshold = -1;        // -1 picks 10 bits per block of the median length
+    int num_jobs = 1;
+    int repeats = 3;
+    double dup_rate = 0.05;    // share of entries that are near-copies of an earlier one
+    int flip_bits = 4;         // at most this many bits differ per block in a near-copy
+    size_t pairs = 2000000;    // random pairs for the hamming_distance benchmark
+    uint64_t seed = 1;
+    std::string only;          // run only benchmarks whose name contains this
+    std::string json_file;
+    std::string dir;
+    bool verbose = false;
+};
+
+// Fill store with a reproducible hash set and return its entries sorted by
+// path, as main() hands them to compare_hashes(). Near-copies keep their
+// source's length most of the time and lose a few trailing blocks
+// otherwise, like a re-encode or trim.
+std::vector<HashStore::Id> generate_hashes(const BenchConfig& config, HashStore& store) {
+    std::mt19937_64 rng(config.seed);
+    std::uniform_real_distribution<double> chance(0.0, 1.0);
+    std::vector<HashStore::Id> ids;
+    ids.reserve(config.entries);
+    bool video = config.lengths.kind != LengthDistribution::Kind::Fixed || config.lengths.a > 1;
+    std::vector<ulong64> hash;
+
+    for (size_t i = 0; i < config.entries; ++i) {
+        int length;
+        if (i > 0 && chance(rng) < config.dup_rate) {
+            HashStore::Id source = ids[std::uniform_int_distribution<size_t>(0, i - 1)(rng)];
+            length = store.length(source);
+            if (length > 3 && chance(rng) < 0.3) {
+                length -= std::uniform_int_distribution<int>(1, 2)(rng);
+            }
+            hash.assign(store.hash(source), store.hash(source) + length);
+            for (int b = 0; b < length; ++b) {
+                int flips = std::uniform_int_distribution<int>(0, config.flip_bits)(rng);
+                for (int f = 0; f < flips; ++f) {
+                    hash[b] ^= 1ULL << (rng() & 63);
+                }
+            }
+        } else {
+            length = config.lengths.sample(rng);
+            hash.resize(length);
+            for (int b = 0; b < length; ++b) {
+                hash[b] = rng();
+            }
+        }
+
+        char name[96];
+        snprintf(name, sizeof(name), "/srv/media/library/%03zu/%s_%07zu.%s", i % 251,
+                 video ? "clip" : "photo", i, video ? "mp4" : "jpg");
+        FileMeta meta;
+        meta.size = video ? 1000000 + rng() % 4000000000ULL : 50000 + rng() % 20000000;
+        meta.mtime_ns = 1500000000000000000LL + static_cast<int64_t>(rng() % 300000000000000000ULL);
+        meta.dev = 2049;
+        meta.ino = 1000 + i;
+        ids.push_back(store.add(name, hash.data(), length, meta));
+    }
+
+    store.sort_by_path(ids);
+    return ids;
+}
+
+// Points a standard descriptor at /dev/null for the lifetime of the object,
+// so compare_hashes() output and progress lines stay out of the report
+class Silence {
+private:
+    int target;
+    int saved = -1;
+
+public:
+    explicit Silence(int fd, bool active = true) : target(fd) {
+        if (!active) return;
+        int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        if (null_fd < 0) return;
+        fflush(nullptr);
+        saved = fcntl(target, F_DUPFD_CLOEXEC, 0);
+        dup2(null_fd, target);
+        close(null_fd);
+    }
+
+    ~Silence() {
+        if (saved < 0) return;
+        fflush(nullptr);
+        dup2(saved, target);
+        close(saved);
+    }
+};
+
+struct BenchResult {
+    std::string name;
+    uint64_t items = 0;   // work per run: pairs, entries or bytes
+    std::string unit;
+    std::vector<double> seconds;
+
+    double best() const { return *std::min_element(seconds.begin(), seconds.end()); }
+    double median() const {
+        std::vector<double> sorted = seconds;
+        std::sort(sorted.begin(), sorted.end());
+        return sorted[sorted.size() / 2];
+    }
+};
+
+class BenchRunner {
+private:
+    const BenchConfig& config;
+    std::vector<BenchResult> results;
+
+public:
+    explicit BenchRunner(const BenchConfig& c) : config(c) {}
+
+    // Runs setup() untimed and then body() timed, config.repeats times
+    template<typename Setup, typename Body>
+    void run(const std::string& name, uint64_t items, const std::string& unit, Setup setup, Body body) {
+        if (!config.only.empty() && name.find(config.only) == std::string::npos) return;
+        BenchResult result{name, items, unit, {}};
+        for (int r = 0; r < config.repeats; ++r) {
+            setup();
+            double start = wall_seconds();
+            body();
+            result.seconds.push_back(wall_seconds() - start);
+        }
+        std::cout << std::left << std::setw(28) << result.name << std::right << std::setw(14) << result.items
+                  << std::setw(12) << std::fixed << std::setprecision(4) << result.best()
+                  << std::setw(12) << result.median()
+                  << std::setw(14) << std::scientific << std::setprecision(3) << per_second(result.items, result.best())
+                  << " " << result.unit << "/s" << std::defaultfloat << std::endl;
+        results.push_back(result);
+    }
+
+    template<typename Body>
+    void run(const std::string& name, uint64_t items, const std::string& unit, Body body) {
+        run(name, items, unit, [] {}, body);
+    }
+
+    bool write_json(const std::string& filename, size_t entries, size_t blocks, int threshold) const {
+        std::ostringstream out;
+        out << std::setprecision(6);
+        out << "{\"entries\":" << entries << ",\"blocks\":" << blocks << ",\"threshold\":" << threshold
+            << ",\"jobs\":" << config.num_jobs << ",\"repeats\":" << config.repeats << ",\"seed\":" << config.seed
+            << ",\"kernels\":\"" << popcount_kernels().name << "\",\"benchmarks\":[";
+        for (size_t i = 0; i < results.size(); ++i) {
+            const BenchResult& r = results[i];
+            if (i > 0) out << ',';
+            out << "{\"name\":\"" << json_escape(r.name) << "\",\"items\":" << r.items << ",\"unit\":\"" << r.unit
+                << "\",\"best_s\":" << r.best() << ",\"median_s\":" << r.median() << ",\"seconds\":[";
+            for (size_t s = 0; s < r.seconds.size(); ++s) {
+                if (s > 0) out << ',';
+                out << r.seconds[s];
+            }
+            out << "]}";
+        }
+        out << "]}\n";
+        if (filename == "-") {
+            std::cout << out.str();
+            return true;
+        }
+        std::ofstream file(filename);
+        file << out.str();
+        return static_cast<bool>(file.flush());
+    }
+};
+
+// --images: hash every file under a directory with ph_dct_imagehash and
+// with scaled decoding, time both and report how far apart the hashes are
+int compare_image_decoders(const std::string& dir, const BenchConfig& config) {
+#ifdef PHASH_COMPARE_SCALED_IMAGES
+    std::vector<std::string> files;
+    std::error_code ec;
+    for (auto it = std::filesystem::recursive_directory_iterator(dir, ec);
+         !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+        if (it->is_regular_file()) files.push_back(it->path().string());
+    }
+    std::sort(files.begin(), files.end());
+    if (files.empty()) {
+        std::cerr << "Error: No files found in " << dir << std::endl;
+        return 1;
+    }
+
+    std::cout << "phash-compare-bench: " << files.size() << " images in " << dir << std::endl;
+    std::cout << std::left << std::setw(28) << "benchmark" << std::right << std::setw(14) << "items"
+              << std::setw(12) << "best s" << std::setw(12) << "median s" << std::setw(14) << "rate" << std::endl;
+
+    BenchRunner bench(config);
+    std::vector<ulong64> full(files.size()), scaled(files.size());
+    std::vector<int> full_result(files.size()), scaled_result(files.size());
+    bench.run("image_hash phash", files.size(), "files", [&] {
+        Silence err(STDERR_FILENO, !config.verbose);
+        for (size_t i = 0; i < files.size(); ++i) {
+            full_result[i] = image_hash(files[i], false, full[i]);
+        }
+    });
+    bench.run("image_hash scaled", files.size(), "files", [&] {
+        Silence err(STDERR_FILENO, !config.verbose);
+        for (size_t i = 0; i < files.size(); ++i) {
+            scaled_result[i] = image_hash(files[i], true, scaled[i]);
+        }
+    });
+
+    // Distances between the two hashes of each file both paths could hash
+    std::map<int, size_t> distances;
+    size_t compared = 0;
+    int worst = 0;
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (full_result[i] != 0 || scaled_result[i] != 0) continue;
+        int distance = ph_hamming_distance(full[i], scaled[i]);
+        ++distances[distance];
+        ++compared;
+        if (distance > worst) {
+            worst = distance;
+            if (config.verbose) std::cout << "  distance " << distance << ": " << files[i] << std::endl;
+        }
+    }
+    std::cout << "Distance between pHash and scaled hashes over " << compared << " images:";
+    for (const auto& d : distances) {
+        std::cout << " " << d.first << ":" << d.second;
+    }
+    std::cout << " (max " << worst << ")" << std::endl;
+
+    if (!config.json_file.empty() && !bench.write_json(config.json_file, files.size(), files.size(), 0)) {
+        std::cerr << "Error: Could not write " << config.json_file << std::endl;
+        return 1;
+    }
+    return 0;
+#else
+    (void)dir;
+    (void)config;
+    std::cerr << "Error: --images needs a build with libjpeg, libpng or libtiff (scaled image decoding)" << std::endl;
+    return 1;
+#endif
+}
+
+void usage(const char* argv0) {
+    std::cerr << "Usage: " << argv0 << " [-n entries] [-l lengths] [-d threshold] [-j jobs] [-r repeats] [--dup-rate fraction] [--flip-bits N] [--pairs N] [--seed N] [--only name] [--json file] [--dir directory] [-v]" << std::endl;
+    std::cerr << "       " << argv0 << " --generate database [--db-format format] [-n entries] [-l lengths] [--dup-rate fraction] [--flip-bits N] [--seed N]" << std::endl;
+    std::cerr << "       " << argv0 << " --images directory [-r repeats] [--json file] [-v]" << std::endl;
+    std::cerr << "Options:" << std::endl;
+    std::cerr << "  -n entries: Number of synthetic hashes (default: 20000)" << std::endl;
+    std::cerr << "  -l lengths: Blocks per hash: N, MIN-MAX or lognormal:MEDIAN:SIGMA (default: 1, image hashes)" << std::endl;
+    std::cerr << "  -d threshold: Comparison threshold (default: 10 per block of the median length)" << std::endl;
+    std::cerr << "  -j jobs: Comparison threads (default: 1)" << std::endl;
+    std::cerr << "  -r repeats: Runs per benchmark; best and median are reported (default: 3)" << std::endl;
+    std::cerr << "  --dup-rate fraction: Share of entries that are near-copies of another (default: 0.05)" << std::endl;
+    std::cerr << "  --flip-bits N: Bits flipped per block in a near-copy, at most (default: 4)" << std::endl;
+    std::cerr << "  --pairs N: Random pairs for the hamming_distance benchmark (default: 2000000)" << std::endl;
+    std::cerr << "  --seed N: Random seed (default: 1)" << std::endl;
+    std::cerr << "  --only name: Run only benchmarks whose name contains name" << std::endl;
+    std::cerr << "  --json file: Also write the results as JSON (- for stdout)" << std::endl;
+    std::cerr << "  --dir directory: Where the database files are written (default: the temporary directory)" << std::endl;
+    std::cerr << "  --generate database: Write the synthetic hashes to a database and exit" << std::endl;
+    std::cerr << "  --db-format format: text or binary, for --generate (default: text)" << std::endl;
+    std::cerr << "  --images directory: Hash the images in directory with pHash and with scaled decoding, compare the two and exit" << std::endl;
+    std::cerr << "  -v: Keep the progress output of the benchmarked code" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    BenchConfig config;
+    std::string generate_file;
+    std::string images_dir;
+    DbFormat db_format = DbFormat::Text;
+
+    enum {
+        OPT_DUP_RATE = 256,
+        OPT_FLIP_BITS,
+        OPT_PAIRS,
+        OPT_SEED,
+        OPT_ONLY,
+        OPT_JSON,
+        OPT_DIR,
+        OPT_GENERATE,
+        OPT_DB_FORMAT,
+        OPT_IMAGES
+    };
+    static const struct option long_options[] = {
+        {"dup-rate", required_argument, nullptr, OPT_DUP_RATE},
+        {"flip-bits", required_argument, nullptr, OPT_FLIP_BITS},
+        {"pairs", required_argument, nullptr, OPT_PAIRS},
+        {"seed", required_argument, nullptr, OPT_SEED},
+        {"only", required_argument, nullptr, OPT_ONLY},
+        {"json", required_argument, nullptr, OPT_JSON},
+        {"dir", required_argument, nullptr, OPT_DIR},
+        {"generate", required_argument, nullptr, OPT_GENERATE},
+        {"db-format", required_argument, nullptr, OPT_DB_FORMAT},
+        {"images", required_argument, nullptr, OPT_IMAGES},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "n:l:d:j:r:vh", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case 'n':
+                config.entries = std::strtoull(optarg, nullptr, 10);
+                break;
+            case 'l':
+                if (!config.lengths.parse(optarg)) {
+                    std::cerr << "Error: Lengths must be N, MIN-MAX or lognormal:MEDIAN:SIGMA" << std::endl;
+                    return 1;
+                }
+                break;
+            case 'd':
+                config.threshold = atoi(optarg);
+                break;
+            case 'j':
+                config.num_jobs = std::max(1, atoi(optarg));
+                break;
+            case 'r':
+                config.repeats = std::max(1, atoi(optarg));
+                break;
+            case 'v':
+                config.verbose = true;
+                break;
+            case OPT_DUP_RATE:
+                config.dup_rate = atof(optarg);
+                break;
+            case OPT_FLIP_BITS:
+                config.flip_bits = std::max(0, atoi(optarg));
+                break;
+            case OPT_PAIRS:
+                config.pairs = std::strtoull(optarg, nullptr, 10);
+                break;
+            case OPT_SEED:
+                config.seed = std::strtoull(optarg, nullptr, 10);
+                break;
+            case OPT_ONLY:
+                config.only = optarg;
+                break;
+            case OPT_JSON:
+                config.json_file = optarg;
+                break;
+            case OPT_DIR:
+                config.dir = optarg;
+                break;
+            case OPT_GENERATE:
+                generate_file = optarg;
+                break;
+            case OPT_DB_FORMAT:
+                {
+                    std::string format = optarg;
+                    if (format == "text") {
+                        db_format = DbFormat::Text;
+                    } else if (format == "binary") {
+                        db_format = DbFormat::Binary;
+                    } else {
+                        std::cerr << "Database format must be one of: text, binary" << std::endl;
+                        return 1;
+                    }
+                }
+                break;
+            case OPT_IMAGES:
+                images_dir = optarg;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (!images_dir.empty()) {
+        return compare_image_decoders(images_dir, config);
+    }
+    if (config.entries < 2) {
+        std::cerr << "Error: At least 2 entries are needed" << std::endl;
+        return 1;
+    }
+
+    HashStore store;
+    std::vector<HashStore::Id> hashes = generate_hashes(config, store);
+    size_t blocks = store.block_count();
+    std::vector<int> lengths;
+    lengths.reserve(hashes.size());
+    for (HashStore::Id id : hashes) {
+        lengths.push_back(store.length(id));
+    }
+    std::nth_element(lengths.begin(), lengths.begin() + lengths.size() / 2, lengths.end());
+    int median_length = lengths[lengths.size() / 2];
+    int threshold = config.threshold >= 0 ? config.threshold : 10 * median_length;
+
+    if (!generate_file.empty()) {
+        if (std::filesystem::exists(generate_file)) {
+            std::cerr << "Error: " << generate_file << " already exists" << std::endl;
+            return 1;
+        }
+        if (!write_database(generate_file, store, hashes, db_format)) {
+            return 1;
+        }
+        std::cerr << "Wrote " << hashes.size() << " synthetic hashes (" << blocks << " blocks) to " << generate_file << std::endl;
+        return 0;
+    }
+
+    std::string dir = config.dir.empty() ? std::filesystem::temp_directory_path().string() : config.dir;
+    std::string work_dir = dir + "/phash-compare-bench." + std::to_string(getpid());
+    std::error_code ec;
+    std::filesystem::create_directories(work_dir, ec);
+    if (ec) {
+        std::cerr << "Error: Could not create " << work_dir << ": " << ec.message() << std::endl;
+        return 1;
+    }
+
+    std::cout << "phash-compare-bench: " << hashes.size() << " hashes, " << blocks << " blocks (median length "
+              << median_length << "), threshold " << threshold << ", " << config.num_jobs << " jobs, "
+              << popcount_kernels().name << " kernels, seed " << config.seed << std::endl;
+    std::cout << std::left << std::setw(28) << "benchmark" << std::right << std::setw(14) << "items"
+              << std::setw(12) << "best s" << std::setw(12) << "median s" << std::setw(14) << "rate" << std::endl;
+
+    BenchRunner bench(config);
+    volatile int64_t sink = 0;
+
+    // Random pairs over the whole set: for video hashes this mixes lengths
+    // the way an unbounded all-pairs run does
+    std::vector<std::pair<uint32_t, uint32_t>> pairs(config.pairs);
+    std::mt19937_64 rng(config.seed ^ 0x9e3779b97f4a7c15ULL);
+    std::uniform_int_distribution<uint32_t> pick(0, static_cast<uint32_t>(hashes.size() - 1));
+    for (auto& p : pairs) {
+        p = {pick(rng), pick(rng)};
+    }
+    bench.run("hamming_distance", pairs.size(), "pairs", [&] {
+        int64_t total = 0;
+        for (const auto& p : pairs) {
+            HashStore::Id a = hashes[p.first];
+            HashStore::Id b = hashes[p.second];
+            total += hamming_distance(store.hash(a), store.length(a), store.hash(b), store.length(b));
+        }
+        sink = sink + total;
+    });
+    pairs.clear();
+    pairs.shrink_to_fit();
+
+    std::vector<std::string> hex(hashes.size());
+    bench.run("hash_to_hex", blocks, "blocks", [&] {
+        for (size_t i = 0; i < hashes.size(); ++i) {
+            hex[i] = hash_to_hex(store.hash(hashes[i]), store.length(hashes[i]));
+        }
+    });
+    if (hex[0].empty()) {
+        for (size_t i = 0; i < hashes.size(); ++i) {
+            hex[i] = hash_to_hex(store.hash(hashes[i]), store.length(hashes[i]));
+        }
+    }
+    bench.run("hex_to_hash", blocks, "blocks", [&] {
+        for (const auto& text : hex) {
+            int length;
+            ulong64* hash = hex_to_hash(text, length);
+            sink = sink + length;
+            free(hash);
+        }
+    });
+    hex.clear();
+    hex.shrink_to_fit();
+
+    for (DbFormat format : {DbFormat::Text, DbFormat::Binary}) {
+        std::string kind = format == DbFormat::Text ? "text" : "binary";
+        std::string database = work_dir + "/hashes." + kind + ".db";
+        bench.run("save_hashes " + kind, hashes.size(), "entries", [&] {
+            std::remove(database.c_str());
+            std::remove(journal_path(database).c_str());
+        }, [&] {
+            save_hashes(database, store, hashes, format);
+        });
+        if (!std::filesystem::exists(database)) {
+            save_hashes(database, store, hashes, format);
+        }
+        bench.run("load_hashes " + kind, hashes.size(), "entries", [&] {
+            HashStore loaded = load_hashes(database);
+            sink = sink + loaded.size();
+        });
+        std::remove(database.c_str());
+    }
+
+    uint64_t all_pairs = static_cast<uint64_t>(hashes.size()) * (hashes.size() - 1) / 2;
+    CompareOptions options;
+    options.threshold = threshold;
+    options.num_jobs = config.num_jobs;
+    for (SearchMode mode : {SearchMode::Brute, SearchMode::Auto}) {
+        options.search_mode = mode;
+        bench.run(mode == SearchMode::Brute ? "compare brute" : "compare auto", all_pairs, "pairs", [&] {
+            Silence out(STDOUT_FILENO);
+            Silence err(STDERR_FILENO, !config.verbose);
+            ResultWriter writer(OutputFormat::Text);
+            sink = sink + compare_hashes(store, hashes, options, writer).matched;
+        });
+    }
+    options.search_mode = SearchMode::Auto;
+    options.cluster = true;
+    bench.run("compare cluster", all_pairs, "pairs", [&] {
+        Silence out(STDOUT_FILENO);
+        Silence err(STDERR_FILENO, !config.verbose);
+        ResultWriter writer(OutputFormat::Text);
+        sink = sink + compare_hashes(store, hashes, options, writer).matched;
+    });
+
+    std::filesystem::remove_all(work_dir, ec);
+
+    if (!config.json_file.empty() && !bench.write_json(config.json_file, hashes.size(), blocks, threshold)) {
+        std::cerr << "Error: Could not write " << config.json_file << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -1,8 +1,12 @@
 #include <iostream>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <cstring>
+#include <cctype>
 #include <cstdlib>
+#include <cerrno>
+#include <cstdio>
 #include <pHash.h>
 #include <set>
 #include <fstream>
@@ -10,32 +14,315 @@
 #include <iomanip>
 #include <map>
 #include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <thread>
 #include <mutex>
+#include <shared_mutex>
+#include <memory>
 #include <queue>
 #include <condition_variable>
 #include <algorithm>
 #include <filesystem>
 #include <regex>
+#include <unordered_map>
+#include <tuple>
+#include <atomic>
+#include <functional>
+#include <chrono>
+#include <array>
+#include <charconv>
+#include <cmath>
 
+// Native video hashing decodes with FFmpeg and hashes frames with CImg,
+// both of which come with pHash in a normal build
+#if __has_include(<libavformat/avformat.h>) && defined(cimg_version)
+#define PHASH_COMPARE_NATIVE_VIDEO 1
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libswscale/swscale.h>
+#include <libavutil/avutil.h>
+}
+#endif
+
+// Scaled image decoding needs CImg for the hash and at least one of the
+// image libraries; CMake defines PHASH_COMPARE_WITH_<LIB> for those it finds
+#if defined(cimg_version) && \
+    (defined(PHASH_COMPARE_WITH_JPEG) || defined(PHASH_COMPARE_WITH_PNG) || defined(PHASH_COMPARE_WITH_TIFF))
+#define PHASH_COMPARE_SCALED_IMAGES 1
+#include <csetjmp>
+#ifdef PHASH_COMPARE_WITH_JPEG
+extern "C" {
+#include <jpeglib.h>
+}
+#endif
+#ifdef PHASH_COMPARE_WITH_PNG
+#include <png.h>
+#endif
+#ifdef PHASH_COMPARE_WITH_TIFF
+#include <tiffio.h>
+#endif
+#endif
+
+// Locality ordering asks Linux filesystems where a file's data starts
+#if __has_include(<linux/fiemap.h>)
+#define PHASH_COMPARE_FIEMAP 1
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define PHASH_COMPARE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+// File identity recorded with each hash, so unchanged files can be trusted
+// and moved files recognised. Entries written before metadata was stored
+// have a zero inode and are treated as unknown.
+struct FileMeta {
+    uint64_t size = 0;
+    int64_t mtime_ns = 0;
+    uint64_t dev = 0;
+    uint64_t ino = 0;
+
+    bool known() const { return ino != 0; }
+    bool operator==(const FileMeta& o) const {
+        return size == o.size && mtime_ns == o.mtime_ns && dev == o.dev && ino == o.ino;
+    }
+    bool operator!=(const FileMeta& o) const { return !(*this == o); }
+};
+
+// Stat a file; returns unknown metadata if it cannot be accessed
+FileMeta stat_file_meta(const std::string& filename) {
+    FileMeta meta;
+    struct stat st;
+    if (stat(filename.c_str(), &st) == 0) {
+        meta.size = st.st_size;
+        meta.mtime_ns = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+        meta.dev = st.st_dev;
+        meta.ino = st.st_ino;
+    }
+    return meta;
+}
+
+// A hash computed by a worker, before it is added to the HashStore. The
+// hash blocks are malloc'd (pHash allocates video hashes itself).
 struct VideoHash {
     std::string filename;
     ulong64* hash;
     int length;
-    VideoHash(const std::string& f, ulong64* h, int l) : filename(f), hash(h), length(l) {}
+    FileMeta meta;
+    VideoHash(const std::string& f, ulong64* h, int l, const FileMeta& m = FileMeta())
+        : filename(f), hash(h), length(l), meta(m) {}
+};
+
+// Interned paths: each distinct path is stored once, in chunks that never
+// move, and referred to by a dense integer ID
+class PathTable {
+private:
+    static const size_t CHUNK_SIZE = 1 << 20;
+
+    std::vector<std::unique_ptr<char[]>> chunks;
+    size_t chunk_used = 0;
+    size_t chunk_size = 0;
+    std::vector<std::string_view> paths;
+    std::unordered_map<std::string_view, uint32_t> ids;
+
+public:
+    static const uint32_t NONE = UINT32_MAX;
+
+    uint32_t intern(std::string_view path) {
+        auto it = ids.find(path);
+        if (it != ids.end()) return it->second;
+        if (path.size() > chunk_size - chunk_used) {
+            chunk_size = std::max(CHUNK_SIZE, path.size());
+            chunks.emplace_back(new char[chunk_size]);
+            chunk_used = 0;
+        }
+        char* copy = chunks.back().get() + chunk_used;
+        std::memcpy(copy, path.data(), path.size());
+        chunk_used += path.size();
+        uint32_t id = static_cast<uint32_t>(paths.size());
+        paths.emplace_back(copy, path.size());
+        ids.emplace(paths.back(), id);
+        return id;
+    }
+
+    uint32_t find(std::string_view path) const {
+        auto it = ids.find(path);
+        return it == ids.end() ? NONE : it->second;
+    }
+
+    std::string_view operator[](uint32_t id) const { return paths[id]; }
+    size_t size() const { return paths.size(); }
+
+    void reserve(size_t count) {
+        paths.reserve(count);
+        ids.reserve(count);
+    }
+};
+
+// Every hash of a run in one place: the hash blocks back to back in a
+// single arena, an offset/length/metadata record per entry, and interned
+// paths. Entries are only appended. Adding an entry for a path that is
+// already stored makes it the current entry for that path; the old one
+// stays valid for anything still holding its ID. Stages pass entry IDs
+// around instead of copying paths and hash blocks. Not thread-safe, and
+// hash() pointers are only valid until the next add().
+class HashStore {
+public:
+    typedef uint32_t Id;
+    static const Id NONE = UINT32_MAX;
+
+private:
+    struct Entry {
+        uint64_t offset; // first block in the arena
+        uint32_t length;
+        uint32_t path;
+        FileMeta meta;
+    };
+
+    std::vector<ulong64> blocks;
+    std::vector<Entry> entries;
+    PathTable paths;
+    std::vector<Id> current; // per path ID, its latest entry
+
+    Id add_entry(std::string_view path, uint64_t offset, int length, const FileMeta& meta) {
+        uint32_t path_id = paths.intern(path);
+        Id id = static_cast<Id>(entries.size());
+        entries.push_back({offset, static_cast<uint32_t>(length), path_id, meta});
+        if (path_id == current.size()) {
+            current.push_back(id);
+        } else {
+            current[path_id] = id;
+        }
+        return id;
+    }
+
+public:
+    void reserve(size_t entry_count, size_t block_count) {
+        entries.reserve(entry_count);
+        current.reserve(entry_count);
+        paths.reserve(entry_count);
+        blocks.reserve(block_count);
+    }
+
+    Id add(std::string_view path, const ulong64* hash, int length, const FileMeta& meta) {
+        uint64_t offset = blocks.size();
+        blocks.insert(blocks.end(), hash, hash + length);
+        return add_entry(path, offset, length, meta);
+    }
+
+    // Copy a run of blocks into the arena for add_at(), e.g. the whole hash
+    // section of a binary database; returns the arena offset of the first
+    uint64_t append_blocks(const ulong64* data, size_t count) {
+        uint64_t offset = blocks.size();
+        blocks.insert(blocks.end(), data, data + count);
+        return offset;
+    }
+
+    // Grow the arena by count blocks to be filled in through blocks_at(),
+    // possibly from several threads at once; returns the offset of the first
+    uint64_t extend_blocks(size_t count) {
+        uint64_t offset = blocks.size();
+        blocks.resize(blocks.size() + count);
+        return offset;
+    }
+
+    ulong64* blocks_at(uint64_t offset) { return blocks.data() + offset; }
+
+    // Entry whose blocks already are in the arena at offset
+    Id add_at(std::string_view path, uint64_t offset, int length, const FileMeta& meta) {
+        return add_entry(path, offset, length, meta);
+    }
+
+    // New entry for path sharing the blocks of an existing entry, for a
+    // file that was moved since it was hashed
+    Id alias(std::string_view path, Id source, const FileMeta& meta) {
+        return add_entry(path, entries[source].offset, entries[source].length, meta);
+    }
+
+    // Leave the entry's path out of find() and current_entries(), e.g. the
+    // old path of a file that was moved
+    void forget(Id id) {
+        if (is_current(id)) current[entries[id].path] = NONE;
+    }
+
+    // Current entry for a path, or NONE
+    Id find(std::string_view path) const {
+        uint32_t path_id = paths.find(path);
+        return path_id == PathTable::NONE ? NONE : current[path_id];
+    }
+
+    bool is_current(Id id) const { return current[entries[id].path] == id; }
+
+    size_t size() const { return entries.size(); }
+    size_t path_count() const { return paths.size(); }
+    size_t block_count() const { return blocks.size(); }
+
+    std::string_view path(Id id) const { return paths[entries[id].path]; }
+    uint32_t path_id(Id id) const { return entries[id].path; }
+    const ulong64* hash(Id id) const { return blocks.data() + entries[id].offset; }
+    int length(Id id) const { return static_cast<int>(entries[id].length); }
+    const FileMeta& meta(Id id) const { return entries[id].meta; }
+    void set_meta(Id id, const FileMeta& meta) { entries[id].meta = meta; }
+
+    // The current entry of every path, ordered by path
+    std::vector<Id> current_entries() const {
+        std::vector<Id> ids;
+        ids.reserve(current.size());
+        for (Id id : current) {
+            if (id != NONE) ids.push_back(id);
+        }
+        sort_by_path(ids);
+        return ids;
+    }
+
+    void sort_by_path(std::vector<Id>& ids) const {
+        std::sort(ids.begin(), ids.end(), [this](Id a, Id b) { return path(a) < path(b); });
+    }
 };
 
-// Thread-safe queue for work distribution
+// Next element of the containers ThreadSafeQueue can sit on
 template<typename T>
+const T& next_of(const std::queue<T>& q) { return q.front(); }
+template<typename T, typename C, typename Compare>
+const T& next_of(const std::priority_queue<T, C, Compare>& q) { return q.top(); }
+
+// Thread-safe queue for work distribution, FIFO by default or ordered when
+// backed by a std::priority_queue. With a capacity, push() blocks while the
+// queue is full so a fast producer cannot run far ahead of the consumers.
+// close() marks the end of input: consumers drain what is left and
+// wait_and_pop() then returns false.
+template<typename T, typename Container = std::queue<T>>
 class ThreadSafeQueue {
 private:
-    std::queue<T> queue;
+    Container queue;
     mutable std::mutex mutex;
     std::condition_variable condition;
+    std::condition_variable not_full;
+    size_t capacity;
+    bool closed = false;
 
 public:
+    explicit ThreadSafeQueue(size_t cap = 0) : capacity(cap) {}
+
     void push(T value) {
-        std::lock_guard<std::mutex> lock(mutex);
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [this] { return capacity == 0 || queue.size() < capacity || closed; });
         queue.push(std::move(value));
         condition.notify_one();
     }
@@ -45,19 +332,31 @@ public:
         if (queue.empty()) {
             return false;
         }
-        value = std::move(queue.front());
+        value = next_of(queue);
         queue.pop();
+        not_full.notify_one();
         return true;
     }
 
     bool wait_and_pop(T& value) {
         std::unique_lock<std::mutex> lock(mutex);
-        condition.wait(lock, [this] { return !queue.empty(); });
-        value = std::move(queue.front());
+        condition.wait(lock, [this] { return !queue.empty() || closed; });
+        if (queue.empty()) {
+            return false;
+        }
+        value = next_of(queue);
         queue.pop();
+        not_full.notify_one();
         return true;
     }
 
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        condition.notify_all();
+        not_full.notify_all();
+    }
+
     bool empty() const {
         std::lock_guard<std::mutex> lock(mutex);
         return queue.empty();
@@ -87,199 +386,4344 @@ public:
         return vector;
     }
 
+    // Copy of the elements pushed since the first `start`
+    std::vector<T> get_from(size_t start) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (start >= vector.size()) return {};
+        return std::vector<T>(vector.begin() + start, vector.end());
+    }
+
     size_t size() const {
         std::lock_guard<std::mutex> lock(mutex);
         return vector.size();
     }
 };
 
+// Popcount kernels over XORed hash blocks. The widest variant the CPU
+// supports is picked once at runtime; the scalar one works everywhere.
+struct PopcountKernels {
+    const char* name;
+    // Sum of popcount(a[k] ^ b[k]) for k < n
+    uint64_t (*xor_sum)(const ulong64* a, const ulong64* b, size_t n);
+    // out[k] = popcount(q ^ b[k]) for k < n
+    void (*xor_many)(ulong64 q, const ulong64* b, size_t n, uint32_t* out);
+    // Like xor_sum, but may stop as soon as the running sum exceeds limit,
+    // returning a partial sum that is still greater than limit
+    uint64_t (*xor_sum_bounded)(const ulong64* a, const ulong64* b, size_t n, uint64_t limit);
+};
+
+// Blocks summed between early-exit checks in the bounded kernels
+const size_t BOUNDED_CHECK_BLOCKS = 16;
+
+static uint64_t xor_sum_scalar(const ulong64* a, const ulong64* b, size_t n) {
+    uint64_t sum = 0;
+    for (size_t k = 0; k < n; ++k) {
+        sum += __builtin_popcountll(a[k] ^ b[k]);
+    }
+    return sum;
+}
+
+static void xor_many_scalar(ulong64 q, const ulong64* b, size_t n, uint32_t* out) {
+    for (size_t k = 0; k < n; ++k) {
+        out[k] = __builtin_popcountll(q ^ b[k]);
+    }
+}
+
+static uint64_t xor_sum_bounded_scalar(const ulong64* a, const ulong64* b, size_t n, uint64_t limit) {
+    uint64_t sum = 0;
+    for (size_t k = 0; k < n; ++k) {
+        sum += __builtin_popcountll(a[k] ^ b[k]);
+        if (sum > limit) break;
+    }
+    return sum;
+}
+
+#ifdef PHASH_COMPARE_X86_KERNELS
+// Per-64-bit-lane popcount via a nibble lookup table and SAD against zero
+__attribute__((target("avx2")))
+static inline __m256i popcount_epi64_avx2(__m256i v) {
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                         0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_mask = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_and_si256(v, low_mask);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+    __m256i bytes = _mm256_add_epi8(_mm256_shuffle_epi8(lut, lo), _mm256_shuffle_epi8(lut, hi));
+    return _mm256_sad_epu8(bytes, _mm256_setzero_si256());
+}
+
+__attribute__((target("avx2")))
+static uint64_t xor_sum_avx2(const ulong64* a, const ulong64* b, size_t n) {
+    __m256i acc = _mm256_setzero_si256();
+    size_t k = 0;
+    for (; k + 4 <= n; k += 4) {
+        __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + k));
+        __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + k));
+        acc = _mm256_add_epi64(acc, popcount_epi64_avx2(_mm256_xor_si256(va, vb)));
+    }
+    alignas(32) uint64_t lanes[4];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), acc);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + xor_sum_scalar(a + k, b + k, n - k);
+}
+
+__attribute__((target("avx2")))
+static void xor_many_avx2(ulong64 q, const ulong64* b, size_t n, uint32_t* out) {
+    const __m256i vq = _mm256_set1_epi64x(static_cast<long long>(q));
+    const __m256i low_dwords = _mm256_setr_epi32(0, 2, 4, 6, 0, 0, 0, 0);
+    size_t k = 0;
+    for (; k + 4 <= n; k += 4) {
+        __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + k));
+        __m256i counts = popcount_epi64_avx2(_mm256_xor_si256(vq, vb));
+        __m256i packed = _mm256_permutevar8x32_epi32(counts, low_dwords);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + k), _mm256_castsi256_si128(packed));
+    }
+    xor_many_scalar(q, b + k, n - k, out + k);
+}
+
+__attribute__((target("avx2")))
+static uint64_t xor_sum_bounded_avx2(const ulong64* a, const ulong64* b, size_t n, uint64_t limit) {
+    uint64_t sum = 0;
+    size_t k = 0;
+    for (; k + BOUNDED_CHECK_BLOCKS <= n; k += BOUNDED_CHECK_BLOCKS) {
+        sum += xor_sum_avx2(a + k, b + k, BOUNDED_CHECK_BLOCKS);
+        if (sum > limit) return sum;
+    }
+    return sum + xor_sum_avx2(a + k, b + k, n - k);
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static uint64_t xor_sum_avx512(const ulong64* a, const ulong64* b, size_t n) {
+    __m512i acc = _mm512_setzero_si512();
+    size_t k = 0;
+    for (; k + 8 <= n; k += 8) {
+        __m512i va = _mm512_loadu_si512(a + k);
+        __m512i vb = _mm512_loadu_si512(b + k);
+        acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(_mm512_xor_si512(va, vb)));
+    }
+    if (k < n) {
+        __mmask8 mask = static_cast<__mmask8>((1u << (n - k)) - 1);
+        __m512i va = _mm512_maskz_loadu_epi64(mask, a + k);
+        __m512i vb = _mm512_maskz_loadu_epi64(mask, b + k);
+        acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(_mm512_xor_si512(va, vb)));
+    }
+    return _mm512_reduce_add_epi64(acc);
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static uint64_t xor_sum_bounded_avx512(const ulong64* a, const ulong64* b, size_t n, uint64_t limit) {
+    uint64_t sum = 0;
+    size_t k = 0;
+    for (; k + BOUNDED_CHECK_BLOCKS <= n; k += BOUNDED_CHECK_BLOCKS) {
+        sum += xor_sum_avx512(a + k, b + k, BOUNDED_CHECK_BLOCKS);
+        if (sum > limit) return sum;
+    }
+    return sum + xor_sum_avx512(a + k, b + k, n - k);
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static void xor_many_avx512(ulong64 q, const ulong64* b, size_t n, uint32_t* out) {
+    const __m512i vq = _mm512_set1_epi64(static_cast<long long>(q));
+    size_t k = 0;
+    for (; k + 8 <= n; k += 8) {
+        __m512i counts = _mm512_popcnt_epi64(_mm512_xor_si512(vq, _mm512_loadu_si512(b + k)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + k), _mm512_cvtepi64_epi32(counts));
+    }
+    xor_many_scalar(q, b + k, n - k, out + k);
+}
+#endif
+
+const PopcountKernels& popcount_kernels() {
+    static const PopcountKernels kernels = [] {
+#ifdef PHASH_COMPARE_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq")) {
+            return PopcountKernels{"avx512", xor_sum_avx512, xor_many_avx512, xor_sum_bounded_avx512};
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            return PopcountKernels{"avx2", xor_sum_avx2, xor_many_avx2, xor_sum_bounded_avx2};
+        }
+#endif
+        return PopcountKernels{"scalar", xor_sum_scalar, xor_many_scalar, xor_sum_bounded_scalar};
+    }();
+    return kernels;
+}
+
 // Helper to compute Hamming distance between two 64-bit hashes
-int hamming_distance(ulong64* hash1, int len1, ulong64* hash2, int len2) {
+int hamming_distance(const ulong64* hash1, int len1, const ulong64* hash2, int len2) {
     int minlen = std::min(len1, len2);
-    int dist = 0;
-    for (int i = 0; i < minlen; ++i) {
-        dist += ph_hamming_distance(hash1[i], hash2[i]);
-    }
+    int dist = static_cast<int>(popcount_kernels().xor_sum(hash1, hash2, minlen));
     // If lengths differ, count extra blocks as max distance
     dist += 64 * std::abs(len1 - len2);
     return dist;
 }
 
-// Convert hash array to hex string
-std::string hash_to_hex(ulong64* hash, int length) {
-    std::stringstream ss;
-    for (int i = 0; i < length; ++i) {
-        if (i > 0) ss << " ";
-        ss << std::hex << std::setw(16) << std::setfill('0') << hash[i];
+// Best alignment of the shorter of two hash sequences inside the longer
+// one: the window distance is summed over the shorter sequence's blocks
+// only, without the length penalty hamming_distance adds. Windows stop
+// early once they cannot beat max_dist or the best window so far. Returns
+// -1 when no window is within max_dist (-1 for max_dist means unbounded);
+// otherwise offset receives the start block in the longer sequence of the
+// first best window.
+int subclip_distance(const ulong64* hash1, int len1, const ulong64* hash2, int len2, int max_dist, int& offset) {
+    const ulong64* clip = len1 <= len2 ? hash1 : hash2;
+    const ulong64* source = len1 <= len2 ? hash2 : hash1;
+    int clip_len = std::min(len1, len2);
+    int source_len = std::max(len1, len2);
+    const PopcountKernels& kernels = popcount_kernels();
+
+    uint64_t bound = max_dist < 0 ? UINT64_MAX : static_cast<uint64_t>(max_dist);
+    uint64_t best = UINT64_MAX;
+    offset = -1;
+    for (int o = 0; o + clip_len <= source_len; ++o) {
+        // Only a strictly better window is kept, so ties report the first
+        uint64_t limit = best == UINT64_MAX ? bound : std::min(bound, best - 1);
+        uint64_t dist = kernels.xor_sum_bounded(clip, source + o, clip_len, limit);
+        if (dist <= limit) {
+            best = dist;
+            offset = o;
+            if (best == 0) break;
+        }
     }
-    return ss.str();
+    return offset < 0 ? -1 : static_cast<int>(best);
 }
 
-// Convert hex string back to hash array
-ulong64* hex_to_hash(const std::string& hex_str, int& length) {
-    std::stringstream ss(hex_str);
-    std::vector<ulong64> hash_vec;
-    ulong64 hash_val;
-    
-    while (ss >> std::hex >> hash_val) {
-        hash_vec.push_back(hash_val);
+// Multi-index hash over single-block (image) hashes. The 64-bit hash is split
+// into m disjoint substrings and each substring gets its own direct-addressed
+// table. If two hashes are within distance d, at least one pair of substrings
+// is within floor(d / m) of each other, so probing every table with all
+// substring variants inside that radius yields every candidate.
+class MultiIndexHash {
+private:
+    struct Table {
+        int shift;
+        int width;
+        std::vector<uint32_t> offsets; // 2^width + 1 bucket boundaries
+        std::vector<uint32_t> ids;     // entry ids ordered by substring value
+    };
+
+    const std::vector<ulong64>& codes;
+    std::vector<Table> tables;
+
+    static ulong64 substring(ulong64 code, const Table& t) {
+        return (code >> t.shift) & ((1ULL << t.width) - 1);
     }
-    
-    length = hash_vec.size();
-    if (length == 0) return nullptr;
-    
-    ulong64* hash = (ulong64*)malloc(length * sizeof(ulong64));
-    for (int i = 0; i < length; ++i) {
-        hash[i] = hash_vec[i];
+
+    // Visit every bucket whose key is within radius of key, flipping bits from
+    // position start upwards so each variant is produced exactly once
+    template<typename F>
+    void probe(size_t t, ulong64 key, int radius, int start, F& visit) const {
+        const Table& table = tables[t];
+        for (uint32_t k = table.offsets[key]; k < table.offsets[key + 1]; ++k) {
+            visit(table.ids[k]);
+        }
+        if (radius == 0) return;
+        for (int b = start; b < table.width; ++b) {
+            probe(t, key ^ (1ULL << b), radius - 1, b + 1, visit);
+        }
     }
-    return hash;
-}
 
-// Load hashes from file
-std::map<std::string, std::pair<ulong64*, int>> load_hashes(const std::string& filename) {
-    std::map<std::string, std::pair<ulong64*, int>> hash_map;
-    std::ifstream file(filename);
-    std::string line;
-    
-    while (std::getline(file, line)) {
-        size_t pos1 = line.find('|');
-        if (pos1 == std::string::npos) continue;
-        
-        size_t pos2 = line.find('|', pos1 + 1);
-        if (pos2 == std::string::npos) continue;
-        
-        std::string filepath = line.substr(0, pos1);
-        int length = std::stoi(line.substr(pos1 + 1, pos2 - pos1 - 1));
-        std::string hex_hash = line.substr(pos2 + 1);
-        
-        int loaded_length;
-        ulong64* hash = hex_to_hash(hex_hash, loaded_length);
-        if (hash && loaded_length == length) {
-            hash_map[filepath] = {hash, length};
+public:
+    // Number of substring tables for n entries: aim for roughly one entry
+    // per bucket, capped so a single table stays small
+    static int table_count(size_t n) {
+        int bits = 8;
+        while (bits < 22 && (1ULL << bits) < n) ++bits;
+        return (64 + bits - 1) / bits;
+    }
+
+    // Number of buckets one query probes over n entries at threshold
+    static size_t probes_per_query(size_t n, int threshold) {
+        int m = table_count(n);
+        int radius = threshold / m;
+        size_t probes = 0;
+        for (int t = 0; t < m; ++t) {
+            int width = 64 / m + (t < 64 % m ? 1 : 0);
+            size_t binom = 1;
+            for (int k = 0; k <= radius && k <= width; ++k) {
+                probes += binom;
+                binom = binom * (width - k) / (k + 1);
+            }
         }
+        return probes;
+    }
+
+    explicit MultiIndexHash(const std::vector<ulong64>& c) : codes(c) {
+        int m = table_count(codes.size());
+        int shift = 0;
+        for (int t = 0; t < m; ++t) {
+            Table table;
+            table.shift = shift;
+            table.width = 64 / m + (t < 64 % m ? 1 : 0);
+            shift += table.width;
+
+            table.offsets.assign((1ULL << table.width) + 1, 0);
+            for (ulong64 code : codes) {
+                table.offsets[substring(code, table) + 1]++;
+            }
+            for (size_t k = 1; k < table.offsets.size(); ++k) {
+                table.offsets[k] += table.offsets[k - 1];
+            }
+            table.ids.resize(codes.size());
+            std::vector<uint32_t> fill(table.offsets.begin(), table.offsets.end() - 1);
+            for (size_t id = 0; id < codes.size(); ++id) {
+                table.ids[fill[substring(codes[id], table)]++] = static_cast<uint32_t>(id);
+            }
+            tables.push_back(std::move(table));
+        }
+    }
+
+    // Call visit(id, dist) once for every entry within threshold of code
+    template<typename F>
+    void query(ulong64 code, int threshold, F visit) const {
+        int radius = threshold / static_cast<int>(tables.size());
+        for (size_t t = 0; t < tables.size(); ++t) {
+            ulong64 key = substring(code, tables[t]);
+            auto candidate = [&](uint32_t id) {
+                ulong64 other = codes[id];
+                // An entry already reachable through an earlier table was
+                // reported there; skip it instead of keeping a seen-set
+                for (size_t u = 0; u < t; ++u) {
+                    if (ph_hamming_distance(substring(code, tables[u]), substring(other, tables[u])) <= radius) {
+                        return;
+                    }
+                }
+                int dist = ph_hamming_distance(code, other);
+                if (dist <= threshold) {
+                    visit(id, dist);
+                }
+            };
+            probe(t, key, radius, 0, candidate);
+        }
+    }
+};
+
+enum class SearchMode { Auto, Brute, Index };
+
+// Byte-identical copies found while scanning, by the entry of the file
+// that was hashed for them. They are reported as distance 0 matches of
+// that entry instead of being compared.
+typedef std::unordered_map<HashStore::Id, std::vector<HashStore::Id>> IdenticalCopies;
+
+// The compared rows of a HashStore, in row order. Multi-block hashes are
+// read in place from the store's arena; when every hash is a single block
+// those are gathered into one array so the kernels stream through it.
+struct FlatHashes {
+    const HashStore& store;
+    const std::vector<HashStore::Id>& ids;
+    std::vector<int> lengths;
+    std::vector<ulong64> blocks; // single-block sets only: row i's hash
+    bool single_block = true;
+    std::vector<const std::vector<HashStore::Id>*> copies; // row i's identical copies, if any
+
+    FlatHashes(const HashStore& store, const std::vector<HashStore::Id>& ids) : store(store), ids(ids) {
+        lengths.reserve(ids.size());
+        for (HashStore::Id id : ids) {
+            lengths.push_back(store.length(id));
+            single_block = single_block && lengths.back() == 1;
+        }
+        if (single_block) {
+            blocks.reserve(ids.size());
+            for (HashStore::Id id : ids) {
+                blocks.push_back(store.hash(id)[0]);
+            }
+        }
+    }
+
+    size_t size() const { return lengths.size(); }
+    const ulong64* hash(size_t i) const { return single_block ? &blocks[i] : store.hash(ids[i]); }
+    std::string_view path(size_t i) const { return store.path(ids[i]); }
+
+    // Returns the number of copies attached
+    size_t attach_copies(const IdenticalCopies& identical) {
+        if (identical.empty()) return 0;
+        size_t count = 0;
+        copies.assign(ids.size(), nullptr);
+        for (size_t i = 0; i < ids.size(); ++i) {
+            auto it = identical.find(ids[i]);
+            if (it != identical.end()) {
+                copies[i] = &it->second;
+                count += it->second.size();
+            }
+        }
+        return count;
+    }
+
+    const std::vector<HashStore::Id>* copies_of(size_t i) const { return copies.empty() ? nullptr : copies[i]; }
+};
+
+// One match of a row's hash against a later hash in the compared set
+struct RowMatch {
+    uint32_t other;
+    int dist;
+    int offset; // sub-clip alignment in the longer hash, -1 otherwise
+    bool operator<(const RowMatch& o) const {
+        return dist < o.dist || (dist == o.dist && other < o.other);
+    }
+};
+
+// Pair counts per pruning stage, summed over all rows
+struct CompareStats {
+    uint64_t pairs = 0;         // pairs in the triangle
+    uint64_t length_pruned = 0; // skipped because the length penalty alone exceeds the threshold
+    uint64_t rejected = 0;      // distance checked and over the threshold
+    uint64_t matched = 0;
+
+    CompareStats& operator+=(const CompareStats& o) {
+        pairs += o.pairs;
+        length_pruned += o.length_pruned;
+        rejected += o.rejected;
+        matched += o.matched;
+        return *this;
+    }
+};
+
+// Matches for a contiguous block of rows, one list per row
+struct RowBlock {
+    size_t begin;
+    std::vector<std::vector<RowMatch>> rows;
+    CompareStats stats;
+};
+
+// Settings shared by the comparison engines
+struct CompareOptions {
+    int threshold = -1;
+    SearchMode search_mode = SearchMode::Auto;
+    int num_jobs = 1;
+    size_t top_k = 0; // 0 keeps every match
+    bool subclip = false;
+    size_t rows = 0;  // compare only the first rows hashes against the rest, 0 for all pairs
+    bool cluster = false;
+    size_t shard = 0; // with shards > 0, compute only rows shard_rows(n, shard, shards) (shard is 1-based)
+    size_t shards = 0;
+};
+
+// Keep a row's match list bounded while it is being filled: once it holds
+// twice the limit, drop everything past the best top_k
+inline void trim_row(std::vector<RowMatch>& row, size_t top_k) {
+    if (top_k > 0 && row.size() >= 2 * top_k) {
+        std::nth_element(row.begin(), row.begin() + top_k, row.end());
+        row.resize(top_k);
     }
-    
-    return hash_map;
 }
 
-// Save hashes to file (thread-safe)
-void save_hashes(const std::string& filename, const std::vector<VideoHash>& hashes) {
-    static std::mutex save_mutex;
-    std::lock_guard<std::mutex> lock(save_mutex);
-    
-    std::ofstream file(filename, std::ios::app);
-    for (const auto& vh : hashes) {
-        file << vh.filename << "|" << vh.length << "|" << hash_to_hex(vh.hash, vh.length) << std::endl;
+// Sort a finished row by distance and apply the top_k limit
+inline void finish_row(std::vector<RowMatch>& row, size_t top_k) {
+    std::sort(row.begin(), row.end());
+    if (top_k > 0 && row.size() > top_k) {
+        row.resize(top_k);
     }
 }
 
-// Recursively find files with specified extensions
-std::vector<std::string> find_files_recursive(const std::vector<std::string>& directories, 
-                                             const std::set<std::string>& extensions) {
-    std::vector<std::string> files;
-    
-    for (const auto& dir : directories) {
-        try {
-            for (const auto& entry : std::filesystem::recursive_directory_iterator(dir)) {
-                if (entry.is_regular_file()) {
-                    std::string ext = entry.path().extension().string();
-                    if (!ext.empty()) {
-                        // Remove leading dot and convert to lowercase
-                        ext = ext.substr(1);
-                        std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
-                        
-                        if (extensions.empty() || extensions.find(ext) != extensions.end()) {
-                            files.push_back(entry.path().string());
-                        }
+// Distance between two hashes under the comparison options, or -1 when it
+// is over the threshold. offset receives the sub-clip alignment, or -1.
+int pair_distance(const ulong64* a, int len_a, const ulong64* b, int len_b, const CompareOptions& options, int& offset) {
+    offset = -1;
+    if (options.subclip) {
+        return subclip_distance(a, len_a, b, len_b, options.threshold, offset);
+    }
+    const PopcountKernels& kernels = popcount_kernels();
+    int penalty = 64 * std::abs(len_a - len_b);
+    int minlen = std::min(len_a, len_b);
+    if (options.threshold < 0) {
+        return static_cast<int>(kernels.xor_sum(a, b, minlen)) + penalty;
+    }
+    if (penalty > options.threshold) return -1;
+    uint64_t limit = options.threshold - penalty;
+    uint64_t dist = kernels.xor_sum_bounded(a, b, minlen, limit);
+    return dist <= limit ? static_cast<int>(dist) + penalty : -1;
+}
+
+// Rows handed to a worker at a time and hashes per column tile. Rows are
+// claimed dynamically because the triangular pair space makes early rows
+// far more expensive than late ones.
+const size_t COMPARE_ROW_BLOCK = 32;
+const size_t COMPARE_COL_TILE = 2048;
+
+// Blocks a worker may run ahead of the oldest unwritten block, per thread
+const size_t COMPARE_REORDER_WINDOW = 4;
+
+// Run compute(row_begin, row_end) over blocks of block_rows rows of
+// [first_row, rows) on num_jobs threads and pass each resulting RowBlock to
+// emit() in row order. Workers stay within a bounded window of the oldest
+// unfinished block, so the results waiting to be written stay bounded too.
+// emit() is never called concurrently.
+template<typename Compute, typename Emit>
+void for_each_row_block_ordered(size_t first_row, size_t rows, int num_jobs, Compute compute, Emit emit,
+                                size_t block_rows = COMPARE_ROW_BLOCK) {
+    size_t blocks = (rows - first_row + block_rows - 1) / block_rows;
+    size_t window = COMPARE_REORDER_WINDOW * std::max(num_jobs, 1);
+    std::mutex mutex;
+    std::condition_variable condition;
+    size_t next_claim = 0;
+    size_t next_emit = 0;
+    bool emitting = false;
+    std::map<size_t, RowBlock> pending;
+
+    auto worker = [&]() {
+        for (;;) {
+            size_t b;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                condition.wait(lock, [&] { return next_claim >= blocks || next_claim < next_emit + window; });
+                if (next_claim >= blocks) return;
+                b = next_claim++;
+            }
+            size_t begin = first_row + b * block_rows;
+            RowBlock block = compute(begin, std::min(rows, begin + block_rows));
+
+            std::unique_lock<std::mutex> lock(mutex);
+            pending.emplace(b, std::move(block));
+            // Whoever finds the next block in order drains; others move on
+            if (emitting) continue;
+            emitting = true;
+            while (!pending.empty() && pending.begin()->first == next_emit) {
+                RowBlock ready = std::move(pending.begin()->second);
+                pending.erase(pending.begin());
+                lock.unlock();
+                emit(ready);
+                lock.lock();
+                ++next_emit;
+                condition.notify_all();
+            }
+            emitting = false;
+        }
+    };
+
+    if (num_jobs <= 1) {
+        worker();
+        return;
+    }
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_jobs; ++t) {
+        threads.emplace_back(worker);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+// Compare one block of rows by brute force. Rows are tiled against column
+// blocks so the column hashes stay in cache while the rows sweep over them.
+RowBlock compare_rows_brute_force(const FlatHashes& flat, const CompareOptions& options, size_t row_begin, size_t row_end) {
+    const PopcountKernels& kernels = popcount_kernels();
+    int threshold = options.threshold;
+    size_t n = flat.size();
+    RowBlock block{row_begin, std::vector<std::vector<RowMatch>>(row_end - row_begin), CompareStats()};
+    std::vector<uint32_t> dists(COMPARE_COL_TILE);
+
+    for (size_t col = row_begin + 1; col < n; col += COMPARE_COL_TILE) {
+        size_t col_end = std::min(n, col + COMPARE_COL_TILE);
+        for (size_t i = row_begin; i < row_end; ++i) {
+            std::vector<RowMatch>& out = block.rows[i - row_begin];
+            size_t j = std::max(col, i + 1);
+            if (j >= col_end) continue;
+            if (flat.single_block) {
+                kernels.xor_many(flat.blocks[i], &flat.blocks[j], col_end - j, dists.data());
+                for (size_t k = 0; j + k < col_end; ++k) {
+                    int dist = static_cast<int>(dists[k]);
+                    if (threshold == -1 || dist <= threshold) {
+                        block.stats.matched++;
+                        out.push_back({static_cast<uint32_t>(j + k), dist, -1});
+                    }
+                }
+            } else if (options.subclip) {
+                for (; j < col_end; ++j) {
+                    int offset;
+                    int dist = subclip_distance(flat.hash(i), flat.lengths[i], flat.hash(j), flat.lengths[j], threshold, offset);
+                    if (dist >= 0) {
+                        block.stats.matched++;
+                        out.push_back({static_cast<uint32_t>(j), dist, offset});
+                    }
+                }
+            } else {
+                for (; j < col_end; ++j) {
+                    int minlen = std::min(flat.lengths[i], flat.lengths[j]);
+                    int dist = static_cast<int>(kernels.xor_sum(flat.hash(i), flat.hash(j), minlen)) +
+                               64 * std::abs(flat.lengths[i] - flat.lengths[j]);
+                    if (threshold == -1 || dist <= threshold) {
+                        block.stats.matched++;
+                        out.push_back({static_cast<uint32_t>(j), dist, -1});
                     }
                 }
             }
-        } catch (const std::filesystem::filesystem_error& e) {
-            std::cerr << "Warning: Could not access directory " << dir << ": " << e.what() << std::endl;
+            trim_row(out, options.top_k);
         }
     }
-    
-    return files;
+    for (size_t i = row_begin; i < row_end; ++i) {
+        std::vector<RowMatch>& row = block.rows[i - row_begin];
+        block.stats.pairs += n - i - 1;
+        finish_row(row, options.top_k);
+    }
+    block.stats.rejected = block.stats.pairs - block.stats.matched;
+    return block;
 }
 
-// Read file list from stdin
-std::vector<std::string> read_files_from_stdin() {
-    std::vector<std::string> files;
-    std::string line;
-    
-    while (std::getline(std::cin, line)) {
-        // Trim whitespace
-        line.erase(0, line.find_first_not_of(" \t\r\n"));
-        line.erase(line.find_last_not_of(" \t\r\n") + 1);
-        
-        if (!line.empty()) {
-            files.push_back(line);
-        }
+// Compare one block of rows through a multi-index hash. Produces exactly
+// the matches brute force would, but only touches candidates within the
+// threshold. Requires threshold >= 0 and every hash to be a single block.
+RowBlock compare_rows_indexed(const FlatHashes& flat, const MultiIndexHash& index, const CompareOptions& options,
+                              size_t row_begin, size_t row_end) {
+    RowBlock block{row_begin, std::vector<std::vector<RowMatch>>(row_end - row_begin), CompareStats()};
+    for (size_t i = row_begin; i < row_end; ++i) {
+        std::vector<RowMatch>& out = block.rows[i - row_begin];
+        block.stats.pairs += flat.size() - i - 1;
+        index.query(flat.blocks[i], options.threshold, [&](uint32_t j, int dist) {
+            if (j > i) {
+                block.stats.matched++;
+                out.push_back({j, dist, -1});
+                trim_row(out, options.top_k);
+            }
+        });
+        finish_row(out, options.top_k);
     }
-    
-    return files;
+    return block;
 }
 
-// Worker thread function for video hashing
-void video_hash_worker(ThreadSafeQueue<std::string>& work_queue, 
-                       ThreadSafeVector<VideoHash>& results,
-                       std::mutex& cerr_mutex) {
+// Row indices grouped by hash length, so video comparisons can skip whole
+// groups whose length penalty (64 per missing block) alone exceeds -d
+struct LengthBuckets {
+    std::vector<int> lengths;                   // distinct lengths, ascending
+    std::vector<std::vector<uint32_t>> members; // row indices per length, ascending
+
+    explicit LengthBuckets(const FlatHashes& flat) {
+        std::map<int, std::vector<uint32_t>> by_length;
+        for (size_t i = 0; i < flat.size(); ++i) {
+            by_length[flat.lengths[i]].push_back(static_cast<uint32_t>(i));
+        }
+        for (auto& bucket : by_length) {
+            lengths.push_back(bucket.first);
+            members.push_back(std::move(bucket.second));
+        }
+    }
+};
+
+// Compare one block of rows against only the length buckets that can still
+// fall within the threshold, using the early-exit kernel with the budget
+// left after the length penalty. Requires threshold >= 0.
+RowBlock compare_rows_bucketed(const FlatHashes& flat, const LengthBuckets& buckets, const CompareOptions& options,
+                               size_t row_begin, size_t row_end) {
+    const PopcountKernels& kernels = popcount_kernels();
+    int max_delta = options.threshold / 64;
+    RowBlock block{row_begin, std::vector<std::vector<RowMatch>>(row_end - row_begin), CompareStats()};
+
+    for (size_t i = row_begin; i < row_end; ++i) {
+        std::vector<RowMatch>& out = block.rows[i - row_begin];
+        int length = flat.lengths[i];
+        uint64_t visited = 0;
+        size_t first = std::lower_bound(buckets.lengths.begin(), buckets.lengths.end(), length - max_delta) - buckets.lengths.begin();
+        for (size_t b = first; b < buckets.lengths.size() && buckets.lengths[b] <= length + max_delta; ++b) {
+            const std::vector<uint32_t>& members = buckets.members[b];
+            int penalty = 64 * std::abs(length - buckets.lengths[b]);
+            uint64_t limit = options.threshold - penalty;
+            int minlen = std::min(length, buckets.lengths[b]);
+            for (auto it = std::upper_bound(members.begin(), members.end(), static_cast<uint32_t>(i)); it != members.end(); ++it) {
+                ++visited;
+                uint64_t dist = kernels.xor_sum_bounded(flat.hash(i), flat.hash(*it), minlen, limit);
+                if (dist <= limit) {
+                    block.stats.matched++;
+                    out.push_back({*it, static_cast<int>(dist) + penalty, -1});
+                    trim_row(out, options.top_k);
+                }
+            }
+        }
+        block.stats.pairs += flat.size() - i - 1;
+        block.stats.length_pruned += flat.size() - i - 1 - visited;
+        finish_row(out, options.top_k);
+    }
+    block.stats.rejected = block.stats.pairs - block.stats.length_pruned - block.stats.matched;
+    return block;
+}
+
+// Union-find over row indices that comparison threads merge matches into
+// concurrently. A set's root is always its smallest index (the larger root
+// is linked under the smaller one), so the groups come out the same
+// whatever order the unions happen in.
+class ConcurrentUnionFind {
+private:
+    std::vector<std::atomic<uint32_t>> parent;
+
+public:
+    explicit ConcurrentUnionFind(size_t n) : parent(n) {
+        for (size_t i = 0; i < n; ++i) {
+            parent[i].store(static_cast<uint32_t>(i), std::memory_order_relaxed);
+        }
+    }
+
+    // Root of x, halving the path on the way up
+    uint32_t find(uint32_t x) {
+        for (;;) {
+            uint32_t p = parent[x].load(std::memory_order_acquire);
+            if (p == x) return x;
+            uint32_t gp = parent[p].load(std::memory_order_acquire);
+            if (gp != p) {
+                parent[x].compare_exchange_weak(p, gp, std::memory_order_acq_rel);
+            }
+            x = gp;
+        }
+    }
+
+    void unite(uint32_t a, uint32_t b) {
+        for (;;) {
+            a = find(a);
+            b = find(b);
+            if (a == b) return;
+            if (a > b) std::swap(a, b);
+            // Fails only if another thread linked b meanwhile; retry from the new roots
+            uint32_t expected = b;
+            if (parent[b].compare_exchange_strong(expected, a, std::memory_order_acq_rel)) return;
+        }
+    }
+};
+
+// Run statistics (--stats, --stats-json). Each stage records wall and CPU
+// time; stages that overlap (scanning and hashing) are timed separately.
+struct StageTime {
+    double wall = 0; // seconds
+    double cpu = 0;  // seconds, user + system
+
+    StageTime& operator+=(const StageTime& o) {
+        wall += o.wall;
+        cpu += o.cpu;
+        return *this;
+    }
+};
+
+double wall_seconds() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+double thread_cpu_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// CPU time of this process (all threads) or of its reaped children
+double process_cpu_seconds(int who = RUSAGE_SELF) {
+    struct rusage usage;
+    getrusage(who, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+// Adds the time from construction to stop() (or destruction) to a stage,
+// with CPU time of the calling thread or of the whole process
+class StageClock {
+private:
+    StageTime& stage;
+    bool thread_only;
+    double wall_start;
+    double cpu_start;
+    bool running = true;
+
+    double cpu_now() const {
+        return thread_only ? thread_cpu_seconds() : process_cpu_seconds();
+    }
+
+public:
+    explicit StageClock(StageTime& s, bool thread = false)
+        : stage(s), thread_only(thread), wall_start(wall_seconds()), cpu_start(cpu_now()) {}
+
+    ~StageClock() {
+        stop();
+    }
+
+    void stop() {
+        if (!running) return;
+        running = false;
+        stage.wall += wall_seconds() - wall_start;
+        stage.cpu += cpu_now() - cpu_start;
+    }
+};
+
+// Per-file hash latencies in power-of-two millisecond buckets: under 1 ms,
+// under 2 ms, ... under 2^(BUCKETS-2) ms, and everything slower
+struct LatencyHistogram {
+    static const int BUCKETS = 20;
+    std::array<uint64_t, BUCKETS> counts{};
+    uint64_t count = 0;
+    double total = 0;
+    double max = 0;
+
+    void add(double seconds) {
+        double ms = seconds * 1000;
+        int bucket = 0;
+        while (bucket < BUCKETS - 1 && ms >= static_cast<double>(1ULL << bucket)) ++bucket;
+        counts[bucket]++;
+        count++;
+        total += seconds;
+        max = std::max(max, seconds);
+    }
+
+    LatencyHistogram& operator+=(const LatencyHistogram& o) {
+        for (int b = 0; b < BUCKETS; ++b) counts[b] += o.counts[b];
+        count += o.count;
+        total += o.total;
+        max = std::max(max, o.max);
+        return *this;
+    }
+};
+
+enum class OutputFormat { Text, Ndjson };
+
+// A member of a duplicate cluster and its distance to the representative
+struct ClusterMember {
+    std::string_view file;
+    int dist;
+    int offset; // sub-clip alignment, -1 otherwise
+};
+
+// Escape a string for use inside a JSON string literal
+std::string json_escape(std::string_view value) {
+    std::string out;
+    out.reserve(value.size() + 2);
+    for (unsigned char c : value) {
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (c < 0x20) {
+                    char escaped[8];
+                    std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    out += escaped;
+                } else {
+                    out += static_cast<char>(c);
+                }
+        }
+    }
+    return out;
+}
+
+// First line of a --shard partial result file: which rows of which hash
+// set the file covers, and the options its matches were found with. The
+// matches follow as "row other distance offset" lines, indices into the
+// compared entries sorted by path, in the order they would be printed.
+struct ShardHeader {
+    size_t shard = 0; // 1-based
+    size_t shards = 0;
+    size_t entries = 0;
+    size_t row_begin = 0;
+    size_t row_end = 0;
+    int threshold = -1;
+    size_t top_k = 0;
+    bool subclip = false;
+    uint64_t fingerprint = 0; // of the compared paths and hashes
+};
+
+std::string format_shard_header(const ShardHeader& header) {
+    char line[256];
+    std::snprintf(line, sizeof(line),
+                  "# phash-compare shard %zu/%zu entries %zu rows %zu-%zu threshold %d top-k %zu subclip %d fingerprint %016llx\n",
+                  header.shard, header.shards, header.entries, header.row_begin, header.row_end, header.threshold,
+                  header.top_k, header.subclip ? 1 : 0, static_cast<unsigned long long>(header.fingerprint));
+    return line;
+}
+
+bool parse_shard_header(const std::string& line, ShardHeader& header) {
+    int subclip;
+    unsigned long long fingerprint;
+    if (std::sscanf(line.c_str(), "# phash-compare shard %zu/%zu entries %zu rows %zu-%zu threshold %d top-k %zu subclip %d fingerprint %llx",
+                    &header.shard, &header.shards, &header.entries, &header.row_begin, &header.row_end,
+                    &header.threshold, &header.top_k, &subclip, &fingerprint) != 9) {
+        return false;
+    }
+    header.subclip = subclip != 0;
+    header.fingerprint = fingerprint;
+    return header.shard >= 1 && header.shard <= header.shards && header.row_begin <= header.row_end &&
+           header.row_end <= header.entries;
+}
+
+// Writes comparison results to stdout through a large buffer instead of
+// flushing every line
+class ResultWriter {
+private:
+    OutputFormat format;
+    std::string buffer;
+    size_t capacity;
+    StageTime write_time;
+    uint64_t bytes_written = 0;
+
+public:
+    explicit ResultWriter(OutputFormat f, size_t cap = 1 << 20) : format(f), capacity(cap) {
+        buffer.reserve(capacity + 4096);
+    }
+
+    ~ResultWriter() {
+        flush();
+    }
+
+    // offset is the sub-clip alignment, or -1 for whole-file comparisons
+    void pair(int dist, std::string_view first_file, std::string_view second_file, int offset = -1) {
+        if (format == OutputFormat::Ndjson) {
+            buffer += "{\"distance\":";
+            buffer += std::to_string(dist);
+            buffer += ",\"file1\":\"";
+            buffer += json_escape(first_file);
+            buffer += "\",\"file2\":\"";
+            buffer += json_escape(second_file);
+            buffer += '"';
+            if (offset >= 0) {
+                buffer += ",\"offset\":";
+                buffer += std::to_string(offset);
+            }
+            buffer += "}\n";
+        } else {
+            buffer += std::to_string(dist);
+            buffer += " - ";
+            buffer += first_file;
+            buffer += " - ";
+            buffer += second_file;
+            if (offset >= 0) {
+                buffer += " - offset ";
+                buffer += std::to_string(offset);
+            }
+            buffer += '\n';
+        }
+        if (buffer.size() >= capacity) {
+            flush();
+        }
+    }
+
+    // One duplicate cluster: text output lists each member as a pair with
+    // the representative, NDJSON writes the whole cluster as one object
+    void cluster(std::string_view representative, const std::vector<ClusterMember>& members) {
+        if (format == OutputFormat::Text) {
+            for (const auto& member : members) {
+                pair(member.dist, representative, member.file, member.offset);
+            }
+            return;
+        }
+        buffer += "{\"representative\":\"";
+        buffer += json_escape(representative);
+        buffer += "\",\"members\":[";
+        for (size_t m = 0; m < members.size(); ++m) {
+            if (m > 0) buffer += ',';
+            buffer += "{\"file\":\"";
+            buffer += json_escape(members[m].file);
+            buffer += "\",\"distance\":";
+            buffer += std::to_string(members[m].dist);
+            if (members[m].offset >= 0) {
+                buffer += ",\"offset\":";
+                buffer += std::to_string(members[m].offset);
+            }
+            buffer += '}';
+        }
+        buffer += "]}\n";
+        if (buffer.size() >= capacity) {
+            flush();
+        }
+    }
+
+    // Partial results of a --shard run, whatever the output format
+    void shard_header(const ShardHeader& header) {
+        buffer += format_shard_header(header);
+    }
+
+    void indexed_pair(size_t row, uint32_t other, int dist, int offset) {
+        buffer += std::to_string(row);
+        buffer += ' ';
+        buffer += std::to_string(other);
+        buffer += ' ';
+        buffer += std::to_string(dist);
+        buffer += ' ';
+        buffer += std::to_string(offset);
+        buffer += '\n';
+        if (buffer.size() >= capacity) {
+            flush();
+        }
+    }
+
+    // Time spent in write() and bytes written, for the output stage
+    const StageTime& output_time() const { return write_time; }
+    uint64_t output_bytes() const { return bytes_written; }
+
+    void flush() {
+        if (buffer.empty()) return;
+        StageClock clock(write_time, true);
+        size_t written = 0;
+        while (written < buffer.size()) {
+            ssize_t n = write(STDOUT_FILENO, buffer.data() + written, buffer.size() - written);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break; // reader went away; drop the rest
+            written += n;
+        }
+        bytes_written += written;
+        buffer.clear();
+    }
+};
+
+// Write the groups of a finished union-find, each once: its first hash as
+// the representative and every other member with its distance to it
+size_t write_clusters(const FlatHashes& flat, ConcurrentUnionFind& clusters, const CompareOptions& options,
+                      ResultWriter& writer) {
+    std::vector<uint32_t> order(flat.size());
+    std::vector<uint32_t> roots(flat.size());
+    for (size_t i = 0; i < flat.size(); ++i) {
+        order[i] = static_cast<uint32_t>(i);
+        roots[i] = clusters.find(static_cast<uint32_t>(i));
+    }
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return roots[a] < roots[b]; });
+
+    // Distances to the representative are reported whatever the threshold:
+    // members can be linked through others and lie further away
+    CompareOptions unbounded = options;
+    unbounded.threshold = -1;
+    size_t count = 0;
+    for (size_t start = 0; start < order.size();) {
+        size_t end = start + 1;
+        while (end < order.size() && roots[order[end]] == roots[order[start]]) ++end;
+        if (end - start > 1 || flat.copies_of(order[start])) {
+            uint32_t representative = order[start];
+            std::vector<RowMatch> row;
+            for (size_t k = start + 1; k < end; ++k) {
+                int offset;
+                int dist = pair_distance(flat.hash(representative), flat.lengths[representative], flat.hash(order[k]),
+                                         flat.lengths[order[k]], unbounded, offset);
+                row.push_back({order[k], dist, offset});
+            }
+            std::sort(row.begin(), row.end());
+            // Copies follow the file they were found identical to, at its distance
+            std::vector<ClusterMember> members;
+            members.reserve(row.size());
+            auto add_copies = [&](uint32_t i, int dist, int offset) {
+                if (const auto* copies = flat.copies_of(i)) {
+                    for (HashStore::Id copy : *copies) {
+                        members.push_back({flat.store.path(copy), dist, offset});
+                    }
+                }
+            };
+            add_copies(representative, 0, options.subclip ? 0 : -1);
+            for (const auto& match : row) {
+                members.push_back({flat.path(match.other), match.dist, match.offset});
+                add_copies(match.other, match.dist, match.offset);
+            }
+            writer.cluster(flat.path(representative), members);
+            ++count;
+        }
+        start = end;
+    }
+    return count;
+}
+
+// Rows [first, second) of shard i (1-based) of n hashes split into shards
+// parts. Row r has n - 1 - r pairs, so the boundaries are placed where the
+// pairs before them reach i/shards of the total; every shard then has about
+// the same number of pairs however many rows that takes.
+std::pair<size_t, size_t> shard_rows(size_t n, size_t shard, size_t shards) {
+    uint64_t total = n < 2 ? 0 : static_cast<uint64_t>(n) * (n - 1) / 2;
+    auto boundary = [&](size_t k) -> size_t {
+        if (k >= shards) return n;
+        uint64_t target = total / shards * k + total % shards * k / shards;
+        // Smallest row with at least target pairs before it
+        size_t low = 0, high = n;
+        while (low < high) {
+            size_t mid = low + (high - low) / 2;
+            uint64_t before = static_cast<uint64_t>(mid) * (2 * static_cast<uint64_t>(n) - mid - 1) / 2;
+            if (before >= target) {
+                high = mid;
+            } else {
+                low = mid + 1;
+            }
+        }
+        return low;
+    };
+    return {boundary(shard - 1), boundary(shard)};
+}
+
+// Writes the rows of a comparison whose hashes have byte-identical copies
+// as a comparison of every path would: each copy gets a row of its own in
+// path order, and matches like the file it copies, at distance 0 from it
+// and from its other copies. A file must sort before its copies, so their
+// rows follow its own. The rows of the compared files are passed in order
+// and untrimmed; top_k is applied here.
+class CopyRowWriter {
+public:
+    CopyRowWriter(const FlatHashes& flat, const CompareOptions& options, ResultWriter& writer)
+        : flat(flat), options(options), writer(writer), position(flat.size()) {
+        // A copy goes after the last file of its segment (the new rows, or
+        // all of them) whose path does not sort after its own
+        segment_end = options.rows > 0 ? std::min(options.rows, flat.size()) : flat.size();
+        for (size_t i = 0; i < flat.size(); ++i) {
+            const auto* copies = flat.copies_of(i);
+            if (!copies) continue;
+            size_t end = i < segment_end ? segment_end : flat.size();
+            for (HashStore::Id copy : *copies) {
+                std::string_view path = flat.store.path(copy);
+                size_t low = i + 1, high = end;
+                while (low < high) {
+                    size_t mid = low + (high - low) / 2;
+                    if (flat.path(mid) > path) {
+                        high = mid;
+                    } else {
+                        low = mid + 1;
+                    }
+                }
+                placed.push_back({low - 1, copy, static_cast<uint32_t>(i), 0});
+            }
+        }
+        std::sort(placed.begin(), placed.end(), [&flat](const Placed& a, const Placed& b) {
+            return a.after < b.after || (a.after == b.after && flat.store.path(a.id) < flat.store.path(b.id));
+        });
+        entries.reserve(flat.size() + placed.size());
+        size_t p = 0;
+        for (size_t i = 0; i < flat.size(); ++i) {
+            position[i] = static_cast<uint32_t>(entries.size());
+            entries.push_back(flat.ids[i]);
+            for (; p < placed.size() && placed[p].after == i; ++p) {
+                placed[p].position = static_cast<uint32_t>(entries.size());
+                entries.push_back(placed[p].id);
+                copies_of[placed[p].source].push_back(p);
+            }
+        }
+    }
+
+    // Write row r of the compared files, then the rows of the copies that
+    // sort between it and the next one
+    void row(size_t r, const std::vector<RowMatch>& matches) {
+        std::vector<RowMatch> earlier; // copies of earlier files that sort after r
+        auto found = earlier_copies.find(r);
+        if (found != earlier_copies.end()) {
+            earlier = std::move(found->second);
+            earlier_copies.erase(found);
+        }
+        auto own = copies_of.find(static_cast<uint32_t>(r));
+        if (own != copies_of.end()) {
+            for (const auto& match : matches) {
+                if (match.other >= segment_end) continue;
+                for (size_t p : own->second) {
+                    if (placed[p].position > position[match.other]) {
+                        earlier_copies[match.other].push_back({placed[p].position, match.dist, match.offset});
+                    }
+                }
+            }
+            for (size_t p : own->second) {
+                pending[p] = row_after(r, placed[p].position, matches, earlier);
+            }
+        }
+        write(position[r], row_after(r, position[r], matches, earlier), matches.size());
+        for (; next_placed < placed.size() && placed[next_placed].after == r; ++next_placed) {
+            auto it = pending.find(next_placed);
+            write(placed[next_placed].position, std::move(it->second), 0);
+            pending.erase(it);
+        }
+    }
+
+    // Pairs written that have a copy on either side
+    uint64_t copy_pairs() const { return copy_pair_count; }
+
+private:
+    struct Placed {
+        size_t after; // compared file the copy sorts after
+        HashStore::Id id;
+        uint32_t source;
+        uint32_t position;
+    };
+
+    // Matches of the entry at position after, whose file is r, against the
+    // entries after it. Rows are kept by position, not compared file.
+    std::vector<RowMatch> row_after(size_t r, uint32_t after, const std::vector<RowMatch>& matches,
+                                    const std::vector<RowMatch>& earlier) const {
+        std::vector<RowMatch> row;
+        auto add = [&](size_t file, int dist, int offset) {
+            if (position[file] > after) row.push_back({position[file], dist, offset});
+            auto copies = copies_of.find(static_cast<uint32_t>(file));
+            if (copies == copies_of.end()) return;
+            for (size_t p : copies->second) {
+                if (placed[p].position > after) row.push_back({placed[p].position, dist, offset});
+            }
+        };
+        add(r, 0, options.subclip ? 0 : -1);
+        for (const auto& match : matches) {
+            add(match.other, match.dist, match.offset);
+        }
+        for (const auto& match : earlier) {
+            if (match.other > after) row.push_back(match);
+        }
+        return row;
+    }
+
+    void write(uint32_t at, std::vector<RowMatch> row, size_t compared) {
+        copy_pair_count += row.size() - compared;
+        finish_row(row, options.top_k);
+        std::string_view first_file = flat.store.path(entries[at]);
+        for (const auto& match : row) {
+            writer.pair(match.dist, first_file, flat.store.path(entries[match.other]), match.offset);
+        }
+    }
+
+    const FlatHashes& flat;
+    const CompareOptions& options;
+    ResultWriter& writer;
+    size_t segment_end;
+    std::vector<uint32_t> position;     // of each compared file in path order
+    std::vector<Placed> placed;         // copies in path order
+    std::vector<HashStore::Id> entries; // by position
+    std::unordered_map<uint32_t, std::vector<size_t>> copies_of;       // compared file -> placed
+    std::unordered_map<size_t, std::vector<RowMatch>> earlier_copies; // by the compared file they match
+    std::unordered_map<size_t, std::vector<RowMatch>> pending;        // built copy rows, by placed index
+    size_t next_placed = 0;
+    uint64_t copy_pair_count = 0;
+};
+
+// Compare all pairs of the store entries in ids, sorted by path, and stream
+// the matches grouped by first file, sorted by distance (ascending) within
+// each group. With options.cluster the matches are merged into groups as
+// they are found instead, and each group is written once at the end. With
+// options.shards only that shard's rows are compared, and their matches
+// are written as row and column indices for merge_shards().
+// Copies in identical are not compared: each is written in a row of its own
+// with the distances of the file it copies, by CopyRowWriter, so the output
+// is that of a comparison of every path (or they join the file's cluster).
+// Returns the pair counts.
+CompareStats compare_hashes(const HashStore& store, const std::vector<HashStore::Id>& ids, const CompareOptions& options,
+                            ResultWriter& writer, const IdenticalCopies& identical = IdenticalCopies()) {
+    FlatHashes flat(store, ids);
+    size_t copy_count = flat.attach_copies(identical);
+    bool thresholded = options.threshold >= 0 && !ids.empty() && !options.subclip;
+    bool indexable = thresholded && flat.single_block;
+
+    // With options.rows only the leading rows of the pair triangle are
+    // computed: those hashes against each other and against everything
+    // after them. Every row then costs about the same, so blocks are made
+    // small enough to keep all threads busy on a few rows.
+    size_t first_row = 0;
+    size_t rows = options.rows > 0 ? std::min(options.rows, flat.size()) : flat.size();
+    std::string subject = rows < flat.size()
+        ? std::to_string(rows) + " new of " + std::to_string(flat.size()) + " hashes"
+        : std::to_string(flat.size()) + " hashes";
+    if (options.shards > 0) {
+        std::tie(first_row, rows) = shard_rows(flat.size(), options.shard, options.shards);
+        subject = "rows " + std::to_string(first_row) + "-" + std::to_string(rows) + " of " +
+                  std::to_string(flat.size()) + " hashes (shard " + std::to_string(options.shard) + "/" +
+                  std::to_string(options.shards) + ")";
+    }
+    size_t block_rows = COMPARE_ROW_BLOCK;
+    if (rows - first_row < flat.size()) {
+        block_rows = std::max<size_t>(1, std::min(COMPARE_ROW_BLOCK, (rows - first_row) / (COMPARE_REORDER_WINDOW * std::max(options.num_jobs, 1))));
+    }
+
+    if (options.search_mode == SearchMode::Index && !indexable) {
+        std::cerr << "Warning: index search needs -d and single-block (image) hashes, not using it" << std::endl;
+    }
+    if (options.search_mode == SearchMode::Auto && indexable) {
+        // The index only pays off when a query probes far fewer buckets
+        // than there are entries to scan, and when there are enough rows to
+        // make up for building it over every hash
+        indexable = MultiIndexHash::probes_per_query(ids.size(), options.threshold) * 4 < ids.size() &&
+                    rows - first_row >= 4 * static_cast<size_t>(MultiIndexHash::table_count(ids.size()));
+    }
+
+    CompareStats stats;
+    // With copies the rows are completed and trimmed by copy_rows, so the
+    // kernels keep every match
+    std::unique_ptr<CopyRowWriter> copy_rows;
+    CompareOptions row_options = options;
+    if (copy_count > 0 && !options.cluster && options.shards == 0) {
+        copy_rows = std::make_unique<CopyRowWriter>(flat, options, writer);
+        row_options.top_k = 0;
+    }
+    auto emit = [&](const RowBlock& block) {
+        stats += block.stats;
+        if (options.shards > 0) {
+            for (size_t r = 0; r < block.rows.size(); ++r) {
+                for (const auto& match : block.rows[r]) {
+                    writer.indexed_pair(block.begin + r, match.other, match.dist, match.offset);
+                }
+            }
+            return;
+        }
+        for (size_t r = 0; r < block.rows.size(); ++r) {
+            if (copy_rows) {
+                copy_rows->row(block.begin + r, block.rows[r]);
+                continue;
+            }
+            std::string_view first_file = flat.path(block.begin + r);
+            for (const auto& match : block.rows[r]) {
+                writer.pair(match.dist, first_file, flat.path(match.other), match.offset);
+            }
+        }
+    };
+
+    // When clustering, the threads merge their block's matches right away
+    // and pass on only the stats, so no pair list is kept
+    ConcurrentUnionFind clusters(options.cluster ? flat.size() : 0);
+    auto run = [&](auto compute) {
+        for_each_row_block_ordered(first_row, rows, options.num_jobs, [&](size_t begin, size_t end) {
+            RowBlock block = compute(begin, end);
+            if (options.cluster) {
+                for (size_t r = 0; r < block.rows.size(); ++r) {
+                    for (const auto& match : block.rows[r]) {
+                        clusters.unite(static_cast<uint32_t>(block.begin + r), match.other);
+                    }
+                }
+                block.rows.clear();
+            }
+            return block;
+        }, emit, block_rows);
+    };
+
+    if (options.search_mode != SearchMode::Brute && indexable) {
+        std::cerr << "Comparing " << subject << " through the index with " << options.num_jobs << " threads..." << std::endl;
+        MultiIndexHash index(flat.blocks);
+        run([&](size_t begin, size_t end) {
+            return compare_rows_indexed(flat, index, row_options, begin, end);
+        });
+        std::cerr << "Pairs: " << stats.pairs << " total, " << stats.matched << " matched through the index" << std::endl;
+    } else {
+        if (options.search_mode != SearchMode::Brute && thresholded && !flat.single_block) {
+            LengthBuckets buckets(flat);
+            std::cerr << "Comparing " << subject << " in " << buckets.lengths.size() << " length buckets with "
+                      << options.num_jobs << " threads (" << popcount_kernels().name << " kernels)..." << std::endl;
+            run([&](size_t begin, size_t end) {
+                return compare_rows_bucketed(flat, buckets, row_options, begin, end);
+            });
+        } else {
+            std::cerr << "Comparing " << subject << (options.subclip ? " as sub-clips" : "")
+                      << " with " << options.num_jobs << " threads (" << popcount_kernels().name << " kernels)..." << std::endl;
+            run([&](size_t begin, size_t end) {
+                return compare_rows_brute_force(flat, row_options, begin, end);
+            });
+        }
+        std::cerr << "Pairs: " << stats.pairs << " total, " << stats.length_pruned << " skipped by length, "
+                  << stats.rejected << " over threshold, " << stats.matched << " matched" << std::endl;
+    }
+
+    if (copy_count > 0) {
+        std::cerr << "Identical: " << copy_count << " byte-identical copies reported without comparing" << std::endl;
+        stats.matched += copy_rows ? copy_rows->copy_pairs() : copy_count;
+    }
+    if (options.cluster) {
+        size_t count = write_clusters(flat, clusters, options, writer);
+        std::cerr << "Clusters: " << count << " groups of duplicates" << std::endl;
+    }
+    writer.flush();
+    return stats;
+}
+
+// Convert hash array to hex string
+std::string hash_to_hex(const ulong64* hash, int length) {
+    std::stringstream ss;
+    for (int i = 0; i < length; ++i) {
+        if (i > 0) ss << " ";
+        ss << std::hex << std::setw(16) << std::setfill('0') << hash[i];
+    }
+    return ss.str();
+}
+
+// Parse space-separated hex blocks into blocks (cleared first)
+void hex_to_blocks(const std::string& hex_str, std::vector<ulong64>& blocks) {
+    std::stringstream ss(hex_str);
+    ulong64 hash_val;
+    blocks.clear();
+    while (ss >> std::hex >> hash_val) {
+        blocks.push_back(hash_val);
+    }
+}
+
+// Convert hex string back to a malloc'd hash array
+ulong64* hex_to_hash(const std::string& hex_str, int& length) {
+    std::vector<ulong64> hash_vec;
+    hex_to_blocks(hex_str, hash_vec);
+    
+    length = hash_vec.size();
+    if (length == 0) return nullptr;
+    
+    ulong64* hash = (ulong64*)malloc(length * sizeof(ulong64));
+    for (int i = 0; i < length; ++i) {
+        hash[i] = hash_vec[i];
+    }
+    return hash;
+}
+
+// On-disk database formats. Text is the original line-based format, with
+// an optional trailing "|size mtime_ns dev ino" metadata field that older
+// readers stop at; binary is a versioned, mmap-able layout:
+//
+//   BinaryDbHeader
+//   BinaryDbEntry[entry_count]      offset table
+//   char[strings_size]              string table (NUL-terminated paths)
+//   padding to 8 bytes
+//   ulong64[blob_count]             all hash blocks, back to back
+//
+// All fields are native-endian; a byte-swapped file fails the version check.
+enum class DbFormat { Text, Binary };
+
+const char BINARY_DB_MAGIC[8] = {'P', 'H', 'A', 'S', 'H', 'D', 'B', '\0'};
+const uint32_t BINARY_DB_VERSION = 2;
+
+struct BinaryDbHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t entry_count;
+    uint64_t entries_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+    uint64_t blob_offset;
+    uint64_t blob_count;
+};
+
+// Version 1 entries stop after hash_length; version 2 adds file metadata
+struct BinaryDbEntry {
+    uint64_t path_offset;  // byte offset into the string table
+    uint64_t hash_offset;  // block offset into the hash blob
+    uint32_t path_length;
+    uint32_t hash_length;
+    uint64_t size;
+    int64_t mtime_ns;
+    uint64_t dev;
+    uint64_t ino;
+};
+
+const size_t BINARY_DB_ENTRY_SIZE_V1 = 24;
+
+static_assert(sizeof(BinaryDbHeader) == 64, "binary database header must stay 64 bytes");
+static_assert(sizeof(BinaryDbEntry) == 56, "binary database entry must stay 56 bytes");
+
+// Check whether a database file starts with the binary magic
+bool is_binary_database(const std::string& filename) {
+    std::ifstream file(filename, std::ios::binary);
+    char magic[sizeof(BINARY_DB_MAGIC)];
+    return file.read(magic, sizeof(magic)) && std::memcmp(magic, BINARY_DB_MAGIC, sizeof(magic)) == 0;
+}
+
+// Text databases are split into chunks of at least this size, one per
+// thread, so small ones are parsed on the calling thread
+const size_t TEXT_DB_MIN_CHUNK = 4 << 20;
+
+// Fields of one text database line: path|length|hex blocks[|metadata]
+struct TextRecordFields {
+    std::string_view path;
+    std::string_view hex;
+    std::string_view meta; // empty when the line has no metadata field
+    int length = 0;        // declared block count
+};
+
+static inline const char* skip_blanks(const char* p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t')) ++p;
+    return p;
+}
+
+// Split a line without its newline; false if it has fewer than three fields
+// or declares more blocks than its hex field can hold
+bool split_text_record(const char* begin, const char* end, TextRecordFields& fields) {
+    const char* pos1 = static_cast<const char*>(std::memchr(begin, '|', end - begin));
+    if (!pos1) return false;
+    const char* pos2 = static_cast<const char*>(std::memchr(pos1 + 1, '|', end - pos1 - 1));
+    if (!pos2) return false;
+    const char* pos3 = static_cast<const char*>(std::memchr(pos2 + 1, '|', end - pos2 - 1));
+    const char* hex_end = pos3 ? pos3 : end;
+
+    fields.path = std::string_view(begin, pos1 - begin);
+    fields.hex = std::string_view(pos2 + 1, hex_end - pos2 - 1);
+    fields.meta = pos3 ? std::string_view(pos3 + 1, end - pos3 - 1) : std::string_view();
+    fields.length = 0;
+    std::from_chars(skip_blanks(pos1 + 1, pos2), pos2, fields.length);
+    return fields.length > 0 && static_cast<size_t>(fields.length) <= fields.hex.size();
+}
+
+// Parse whitespace-separated hex blocks into out, which has room for max
+// blocks. Like reading them with std::hex, parsing stops at the first
+// character that cannot continue a block. Returns the number of blocks, or
+// max + 1 if there are more.
+int parse_hex_blocks(std::string_view hex, ulong64* out, int max) {
+    const char* p = hex.data();
+    const char* end = p + hex.size();
+    int count = 0;
+    for (;;) {
+        p = skip_blanks(p, end);
+        ulong64 value;
+        auto parsed = std::from_chars(p, end, value, 16);
+        if (parsed.ec != std::errc()) break;
+        if (count == max) return max + 1;
+        out[count++] = value;
+        p = parsed.ptr;
+        if (p < end && *p != ' ' && *p != '\t') break;
+    }
+    return count;
+}
+
+// Whether a last line written without its newline is a whole record rather
+// than the start of one that was cut short: it must parse, and its hash must
+// have been written out in full, as shown by a metadata field after it or by
+// all 16 digits of its last block. Cut metadata only makes the file look
+// changed, so it is hashed again.
+bool complete_text_record(const char* begin, const char* end) {
+    TextRecordFields fields;
+    if (!split_text_record(begin, end, fields)) return false;
+    std::vector<ulong64> blocks(fields.length);
+    if (parse_hex_blocks(fields.hex, blocks.data(), fields.length) != fields.length) return false;
+    const char* hex_end = fields.hex.data() + fields.hex.size();
+    if (hex_end < end) return true;
+    while (hex_end > fields.hex.data() && (hex_end[-1] == ' ' || hex_end[-1] == '\t')) --hex_end;
+    int digits = 0;
+    while (hex_end > fields.hex.data() && std::isxdigit(static_cast<unsigned char>(hex_end[-1]))) {
+        --hex_end;
+        ++digits;
+    }
+    return digits == 16;
+}
+
+// Parse "size mtime_ns dev ino"; unknown metadata if any field is missing
+FileMeta parse_text_meta(std::string_view text) {
+    FileMeta meta;
+    const char* p = text.data();
+    const char* end = p + text.size();
+    auto next = [&](auto& value) {
+        p = skip_blanks(p, end);
+        auto parsed = std::from_chars(p, end, value);
+        p = parsed.ptr;
+        return parsed.ec == std::errc();
+    };
+    if (!(next(meta.size) && next(meta.mtime_ns) && next(meta.dev) && next(meta.ino))) {
+        return FileMeta();
+    }
+    return meta;
+}
+
+// One chunk of a text database, parsed on its own thread. Paths point into
+// the file mapping; blocks go straight to the chunk's slice of the arena.
+struct TextChunk {
+    struct Record {
+        std::string_view path;
+        uint64_t offset; // blocks from the start of the chunk's slice
+        int length;      // 0 if the line turned out not to parse
+        FileMeta meta;
+    };
+
+    const char* begin;
+    const char* end;
+    size_t blocks = 0;
+    uint64_t arena_offset = 0;
+    std::vector<Record> records;
+
+    TextChunk(const char* begin, const char* end) : begin(begin), end(end) {}
+
+    // End of the line at line: its newline, or the end of the chunk for a
+    // last record written without one
+    const char* line_end(const char* line) const {
+        const char* nl = static_cast<const char*>(std::memchr(line, '\n', end - line));
+        return nl ? nl : end;
+    }
+
+    // First pass: room needed for the lines that can be entries
+    void count() {
+        TextRecordFields fields;
+        for (const char* line = begin; line < end;) {
+            const char* nl = line_end(line);
+            if (split_text_record(line, nl, fields)) {
+                blocks += fields.length;
+                records.push_back({});
+            }
+            line = nl < end ? nl + 1 : end;
+        }
+    }
+
+    // Second pass: parse into arena, which holds this chunk's slice
+    void parse(ulong64* arena) {
+        TextRecordFields fields;
+        size_t r = 0;
+        uint64_t used = 0;
+        for (const char* line = begin; line < end;) {
+            const char* nl = line_end(line);
+            if (split_text_record(line, nl, fields)) {
+                Record& record = records[r++];
+                record.path = fields.path;
+                record.offset = used;
+                record.length = parse_hex_blocks(fields.hex, arena + used, fields.length) == fields.length ? fields.length : 0;
+                if (!fields.meta.empty()) record.meta = parse_text_meta(fields.meta);
+                used += fields.length;
+            }
+            line = nl < end ? nl + 1 : end;
+        }
+    }
+};
+
+// Load hashes from a text database. A last line without its newline is
+// kept only if complete_text_record() accepts it; otherwise it is the tail
+// of an append that was cut short (a crash during a checkpoint) and is
+// ignored. Entries are added to store, later lines replacing earlier ones
+// for a path.
+//
+// The file is mapped and split at line boundaries into one chunk per
+// thread. Each chunk is counted, the arena is grown once for all of them,
+// and the chunks are parsed in parallel into their slices. The entries are
+// then added in file order, so later duplicates still win.
+void load_hashes_text(const std::string& filename, HashStore& store) {
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return;
+    }
+    size_t size = st.st_size;
+    void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        std::cerr << "Error: Could not map database " << filename << ": " << std::strerror(errno) << std::endl;
+        return;
+    }
+    // Each thread reads its own chunk, so the file is not read in order
+    madvise(mapping, size, MADV_WILLNEED);
+
+    const char* base = static_cast<const char*>(mapping);
+    const char* last_newline = static_cast<const char*>(memrchr(base, '\n', size));
+    const char* end = last_newline ? last_newline + 1 : base;
+    if (end < base + size) {
+        if (complete_text_record(end, base + size)) {
+            end = base + size;
+        } else {
+            std::cerr << "Warning: Ignoring incomplete last record in " << filename << std::endl;
+        }
+    }
+
+    size_t threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+    threads = std::max<size_t>(1, std::min(threads, static_cast<size_t>(end - base) / TEXT_DB_MIN_CHUNK));
+    std::vector<TextChunk> chunks;
+    for (const char* begin = base; begin < end;) {
+        const char* split = begin + std::max<size_t>(1, (end - base) / threads);
+        if (split >= end || chunks.size() + 1 == threads) {
+            split = end;
+        } else {
+            const char* nl = static_cast<const char*>(std::memchr(split - 1, '\n', end - split + 1));
+            split = nl ? nl + 1 : end;
+        }
+        chunks.emplace_back(begin, split);
+        begin = split;
+    }
+
+    auto in_parallel = [&](auto work) {
+        if (chunks.size() == 1) {
+            work(chunks[0]);
+            return;
+        }
+        std::vector<std::thread> workers;
+        for (auto& chunk : chunks) {
+            workers.emplace_back([&work, &chunk] { work(chunk); });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    };
+
+    in_parallel([](TextChunk& chunk) { chunk.count(); });
+    size_t records = 0;
+    size_t blocks = 0;
+    for (auto& chunk : chunks) {
+        records += chunk.records.size();
+        blocks += chunk.blocks;
+    }
+    store.reserve(store.size() + records, store.block_count() + blocks);
+    for (auto& chunk : chunks) {
+        chunk.arena_offset = store.extend_blocks(chunk.blocks);
+    }
+    in_parallel([&store](TextChunk& chunk) { chunk.parse(store.blocks_at(chunk.arena_offset)); });
+
+    for (auto& chunk : chunks) {
+        for (const auto& record : chunk.records) {
+            if (record.length > 0) {
+                store.add_at(record.path, chunk.arena_offset + record.offset, record.length, record.meta);
+            }
+        }
+        chunk.records = std::vector<TextChunk::Record>();
+    }
+    munmap(mapping, size);
+}
+
+// Load hashes from a binary database into store. The file is mapped
+// read-only, its whole hash section is copied into the store's arena in
+// one go, and the mapping is released again.
+void load_hashes_binary(const std::string& filename, HashStore& store) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(BinaryDbHeader)) {
+        close(fd);
+        return;
+    }
+    size_t size = st.st_size;
+    void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        std::cerr << "Error: Could not map database " << filename << ": " << std::strerror(errno) << std::endl;
+        return;
+    }
+
+    const char* base = static_cast<const char*>(mapping);
+    const BinaryDbHeader* header = reinterpret_cast<const BinaryDbHeader*>(base);
+    size_t entry_size = header->version == 1 ? BINARY_DB_ENTRY_SIZE_V1 : sizeof(BinaryDbEntry);
+    bool valid = (header->version == 1 || header->version == BINARY_DB_VERSION) &&
+        header->header_size == sizeof(BinaryDbHeader) &&
+        header->entries_offset % sizeof(uint64_t) == 0 && header->entries_offset <= size &&
+        header->entry_count <= (size - header->entries_offset) / entry_size &&
+        header->strings_offset <= size && header->strings_size <= size - header->strings_offset &&
+        header->blob_offset % sizeof(ulong64) == 0 && header->blob_offset <= size &&
+        header->blob_count <= (size - header->blob_offset) / sizeof(ulong64);
+    if (!valid) {
+        std::cerr << "Error: Unsupported or corrupt binary database " << filename << std::endl;
+        munmap(mapping, size);
+        return;
+    }
+
+    const char* strings = base + header->strings_offset;
+    const ulong64* blob = reinterpret_cast<const ulong64*>(base + header->blob_offset);
+    store.reserve(store.size() + header->entry_count, store.block_count() + header->blob_count);
+    uint64_t blob_start = store.append_blocks(blob, header->blob_count);
+    for (uint64_t e = 0; e < header->entry_count; ++e) {
+        const BinaryDbEntry& entry = *reinterpret_cast<const BinaryDbEntry*>(base + header->entries_offset + e * entry_size);
+        if (entry.path_offset > header->strings_size ||
+            entry.path_length > header->strings_size - entry.path_offset ||
+            entry.hash_offset > header->blob_count ||
+            entry.hash_length > header->blob_count - entry.hash_offset ||
+            entry.hash_length == 0) {
+            continue;
+        }
+        FileMeta meta;
+        if (header->version >= 2) {
+            meta.size = entry.size;
+            meta.mtime_ns = entry.mtime_ns;
+            meta.dev = entry.dev;
+            meta.ino = entry.ino;
+        }
+        std::string_view filepath(strings + entry.path_offset, entry.path_length);
+        store.add_at(filepath, blob_start + entry.hash_offset, static_cast<int>(entry.hash_length), meta);
+    }
+
+    munmap(mapping, size);
+}
+
+// Checkpoints of a binary database go to a text journal next to it
+// (<database>.journal), since the binary layout cannot be appended to. The
+// journal is folded in on load and removed when the database is rewritten.
+std::string journal_path(const std::string& database) {
+    return database + ".journal";
+}
+
+// Load hashes from file, detecting the database format
+HashStore load_hashes(const std::string& filename) {
+    HashStore store;
+    if (is_binary_database(filename)) {
+        load_hashes_binary(filename, store);
+        std::string journal = journal_path(filename);
+        if (std::filesystem::exists(journal)) {
+            load_hashes_text(journal, store);
+        }
+        return store;
+    }
+    load_hashes_text(filename, store);
+    return store;
+}
+
+// Format one text database line, including metadata when it is known
+std::string format_text_record(std::string_view path, const ulong64* hash, int length, const FileMeta& meta) {
+    std::string line(path);
+    line += "|" + std::to_string(length) + "|" + hash_to_hex(hash, length);
+    if (meta.known()) {
+        line += "|" + std::to_string(meta.size) + " " + std::to_string(meta.mtime_ns) + " " +
+                std::to_string(meta.dev) + " " + std::to_string(meta.ino);
+    }
+    return line + "\n";
+}
+
+std::string format_text_record(const HashStore& store, HashStore::Id id) {
+    return format_text_record(store.path(id), store.hash(id), store.length(id), store.meta(id));
+}
+
+// Write the given store entries as a whole database to a temporary file and
+// rename it into place, so readers only ever see the old or the new
+// complete file
+bool write_database(const std::string& filename, const HashStore& store, const std::vector<HashStore::Id>& ids,
+                    DbFormat format) {
+    std::string tmp_name = filename + ".tmp";
+    FILE* file = std::fopen(tmp_name.c_str(), "wb");
+    if (!file) {
+        std::cerr << "Error: Could not write " << tmp_name << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    bool ok = true;
+    if (format == DbFormat::Text) {
+        for (HashStore::Id id : ids) {
+            std::string line = format_text_record(store, id);
+            ok = ok && std::fwrite(line.data(), 1, line.size(), file) == line.size();
+        }
+    } else {
+        BinaryDbHeader header = {};
+        std::memcpy(header.magic, BINARY_DB_MAGIC, sizeof(header.magic));
+        header.version = BINARY_DB_VERSION;
+        header.header_size = sizeof(BinaryDbHeader);
+        header.entry_count = ids.size();
+        header.entries_offset = sizeof(BinaryDbHeader);
+
+        std::vector<BinaryDbEntry> entries;
+        entries.reserve(ids.size());
+        std::string strings;
+        for (HashStore::Id id : ids) {
+            std::string_view path = store.path(id);
+            const FileMeta& meta = store.meta(id);
+            entries.push_back({strings.size(), header.blob_count,
+                               static_cast<uint32_t>(path.size()), static_cast<uint32_t>(store.length(id)),
+                               meta.size, meta.mtime_ns, meta.dev, meta.ino});
+            strings += path;
+            strings += '\0';
+            header.blob_count += store.length(id);
+        }
+        header.strings_offset = header.entries_offset + entries.size() * sizeof(BinaryDbEntry);
+        header.strings_size = strings.size();
+        header.blob_offset = (header.strings_offset + header.strings_size + 7) & ~uint64_t(7);
+        strings.resize(header.blob_offset - header.strings_offset, '\0');
+
+        ok = std::fwrite(&header, sizeof(header), 1, file) == 1 &&
+             (entries.empty() || std::fwrite(entries.data(), sizeof(BinaryDbEntry), entries.size(), file) == entries.size()) &&
+             std::fwrite(strings.data(), 1, strings.size(), file) == strings.size();
+        for (HashStore::Id id : ids) {
+            size_t length = store.length(id);
+            ok = ok && std::fwrite(store.hash(id), sizeof(ulong64), length, file) == length;
+        }
+    }
+
+    ok = ok && std::fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = std::fclose(file) == 0 && ok;
+    if (!ok || std::rename(tmp_name.c_str(), filename.c_str()) != 0) {
+        std::cerr << "Error: Could not write database " << filename << ": " << std::strerror(errno) << std::endl;
+        std::remove(tmp_name.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Append formatted text records with a single write and fsync them. A
+// record left cut short by an earlier crash is cut off first, so the new
+// records start on a line of their own and the torn one can never parse as
+// an entry; a complete last record without its newline gets one instead.
+bool append_text_records(const std::string& filename, const std::string& data) {
+    int fd = open(filename.c_str(), O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        std::cerr << "Error: Could not append to " << filename << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    std::string newline;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        off_t end = st.st_size;
+        char buf[4096];
+        while (end > 0) {
+            off_t start = end > static_cast<off_t>(sizeof(buf)) ? end - static_cast<off_t>(sizeof(buf)) : 0;
+            ssize_t n = pread(fd, buf, end - start, start);
+            if (n != end - start) break;
+            const char* nl = static_cast<const char*>(memrchr(buf, '\n', n));
+            if (nl) {
+                end = start + (nl - buf) + 1;
+                break;
+            }
+            end = start;
+        }
+        std::string tail(static_cast<size_t>(st.st_size - end), '\0');
+        if (end < st.st_size && pread(fd, &tail[0], tail.size(), end) == static_cast<ssize_t>(tail.size()) &&
+            complete_text_record(tail.data(), tail.data() + tail.size())) {
+            newline = "\n";
+        } else if (end < st.st_size) {
+            std::cerr << "Warning: Dropping incomplete last record in " << filename << std::endl;
+            if (ftruncate(fd, end) != 0) {
+                std::cerr << "Error: Could not repair " << filename << ": " << std::strerror(errno) << std::endl;
+                close(fd);
+                return false;
+            }
+        }
+    }
+
+    std::string records = newline + data;
+    bool ok = true;
+    for (size_t done = 0; ok && done < records.size();) {
+        ssize_t n = write(fd, records.data() + done, records.size() - done);
+        if (n < 0 && errno == EINTR) continue;
+        ok = n > 0;
+        if (ok) done += n;
+    }
+    ok = ok && fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    if (!ok) {
+        std::cerr << "Error: Could not append to " << filename << ": " << std::strerror(errno) << std::endl;
+    }
+    return ok;
+}
+
+// Save hashes to file (thread-safe). Text databases are appended to; a
+// binary database is rewritten with the new entries and its journal merged
+// in. The entries of the paths in dropped (old paths of moved files) are
+// removed, for which a text database is rewritten as well. new_format only
+// applies when the database does not exist yet.
+void save_hashes(const std::string& filename, const HashStore& store, const std::vector<HashStore::Id>& ids,
+                 DbFormat new_format = DbFormat::Text, const std::vector<std::string>& dropped = {}) {
+    static std::mutex save_mutex;
+    std::lock_guard<std::mutex> lock(save_mutex);
+
+    bool exists = std::filesystem::exists(filename);
+    bool binary = exists ? is_binary_database(filename) : new_format == DbFormat::Binary;
+    if (binary || (exists && !dropped.empty())) {
+        HashStore merged;
+        if (exists) merged = load_hashes(filename);
+        for (const auto& path : dropped) {
+            HashStore::Id id = merged.find(path);
+            if (id != HashStore::NONE) merged.forget(id);
+        }
+        for (HashStore::Id id : ids) {
+            merged.add(store.path(id), store.hash(id), store.length(id), store.meta(id));
+        }
+        if (write_database(filename, merged, merged.current_entries(), binary ? DbFormat::Binary : DbFormat::Text) &&
+            binary) {
+            std::remove(journal_path(filename).c_str());
+        }
+        return;
+    }
+    
+    std::string data;
+    for (HashStore::Id id : ids) {
+        data += format_text_record(store, id);
+    }
+    append_text_records(filename, data);
+}
+
+// Persist a batch of formatted text records while hashing is still running:
+// appended to a text database, or to the journal of a binary one. A
+// database that does not exist yet is created in new_format.
+bool checkpoint_hashes(const std::string& filename, const std::string& records, DbFormat new_format) {
+    bool exists = std::filesystem::exists(filename);
+    if (exists ? is_binary_database(filename) : new_format == DbFormat::Binary) {
+        if (!exists) {
+            HashStore none;
+            if (!write_database(filename, none, {}, DbFormat::Binary)) return false;
+        }
+        return append_text_records(journal_path(filename), records);
+    }
+    return append_text_records(filename, records);
+}
+
+// Convert a database between the text and binary formats
+bool convert_database(const std::string& source, const std::string& target, DbFormat format) {
+    HashStore loaded = load_hashes(source);
+    std::vector<HashStore::Id> ids = loaded.current_entries();
+    if (!write_database(target, loaded, ids, format)) {
+        return false;
+    }
+    std::cerr << "Converted " << ids.size() << " hashes from " << source << " to "
+              << (format == DbFormat::Binary ? "binary" : "text") << " database " << target << std::endl;
+    return true;
+}
+
+// Whether path is known to be gone, as opposed to unreadable
+bool file_missing(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) != 0 && (errno == ENOENT || errno == ENOTDIR);
+}
+
+// Drop entries whose files no longer exist and record metadata for entries
+// written before it was stored, rewriting the database in its own format
+bool prune_database(const std::string& filename) {
+    HashStore loaded = load_hashes(filename);
+    std::vector<HashStore::Id> ids = loaded.current_entries();
+    std::vector<HashStore::Id> kept;
+    kept.reserve(ids.size());
+    size_t backfilled = 0;
+    for (HashStore::Id id : ids) {
+        std::string path(loaded.path(id));
+        if (file_missing(path)) {
+            continue;
+        }
+        if (!loaded.meta(id).known()) {
+            FileMeta meta = stat_file_meta(path);
+            if (meta.known()) {
+                loaded.set_meta(id, meta);
+                ++backfilled;
+            }
+        }
+        kept.push_back(id);
+    }
+    DbFormat format = is_binary_database(filename) ? DbFormat::Binary : DbFormat::Text;
+    if (!write_database(filename, loaded, kept, format)) {
+        return false;
+    }
+    if (format == DbFormat::Binary) {
+        std::remove(journal_path(filename).c_str());
+    }
+    std::cerr << "Pruned " << ids.size() - kept.size() << " entries for missing files from " << filename
+              << ", kept " << kept.size() << " (" << backfilled << " given file metadata)" << std::endl;
+    return true;
+}
+
+// Recursively find files with specified extensions, passing each one to
+// emit as soon as it is found
+void find_files_recursive(const std::vector<std::string>& directories, 
+                          const std::set<std::string>& extensions,
+                          const std::function<void(const std::string&)>& emit) {
+
+    for (const auto& dir : directories) {
+        try {
+            for (const auto& entry : std::filesystem::recursive_directory_iterator(dir)) {
+                if (entry.is_regular_file()) {
+                    std::string ext = entry.path().extension().string();
+                    if (!ext.empty()) {
+                        // Remove leading dot and convert to lowercase
+                        ext = ext.substr(1);
+                        std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+                        
+                        if (extensions.empty() || extensions.find(ext) != extensions.end()) {
+                            emit(entry.path().string());
+                        }
+                    }
+                }
+            }
+        } catch (const std::filesystem::filesystem_error& e) {
+            std::cerr << "Warning: Could not access directory " << dir << ": " << e.what() << std::endl;
+        }
+    }
+}
+
+// Read file list from stdin, passing each file to emit as it is read
+void read_files_from_stdin(const std::function<void(const std::string&)>& emit) {
+    std::string line;
+    
+    while (std::getline(std::cin, line)) {
+        // Trim whitespace
+        line.erase(0, line.find_first_not_of(" \t\r\n"));
+        line.erase(line.find_last_not_of(" \t\r\n") + 1);
+        
+        if (!line.empty()) {
+            emit(line);
+        }
+    }
+}
+
+// A file waiting to be hashed. Ordered by size so the work queue hands out
+// the largest files first and a huge video picked up last cannot keep one
+// thread busy long after the others are done. With --readahead, files are
+// ordered by their place on disk instead (see file_location()), lowest
+// first, so the disk sweeps across them rather than seeking at random.
+struct HashJob {
+    std::string filename;
+    FileMeta meta;
+    bool by_location = false;
+    uint64_t location = 0;
+    bool operator<(const HashJob& o) const {
+        if (by_location) {
+            return std::tie(o.meta.dev, o.location, o.filename) < std::tie(meta.dev, location, filename);
+        }
+        return meta.size < o.meta.size || (meta.size == o.meta.size && filename > o.filename);
+    }
+};
+
+// Open a file for a hint about its data (extents, readahead) without reading
+// it: without updating its atime where allowed, and without blocking on a
+// FIFO or device node, which are not opened at all. Returns -1 on failure.
+int open_regular_file(const std::string& filename) {
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC | O_NONBLOCK | O_NOATIME);
+    if (fd < 0) fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    struct stat st;
+    if (fd >= 0 && (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Where a file's data lies on its device, for ordering reads: the physical
+// offset of its first extent where the filesystem reports extents (FIEMAP),
+// otherwise its inode number, which filesystems tend to allocate near the
+// data. Inode positions sort after all extent positions of the device.
+uint64_t file_location(const std::string& filename, const FileMeta& meta, bool& by_extent) {
+    by_extent = false;
+#ifdef PHASH_COMPARE_FIEMAP
+    int fd = open_regular_file(filename);
+    if (fd >= 0) {
+        alignas(struct fiemap) char buffer[sizeof(struct fiemap) + sizeof(struct fiemap_extent)] = {};
+        struct fiemap* map = reinterpret_cast<struct fiemap*>(buffer);
+        map->fm_start = 0;
+        map->fm_length = FIEMAP_MAX_OFFSET;
+        map->fm_extent_count = 1;
+        bool mapped = ioctl(fd, FS_IOC_FIEMAP, map) == 0 && map->fm_mapped_extents == 1 &&
+                      !(map->fm_extents[0].fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE));
+        close(fd);
+        if (mapped) {
+            by_extent = true;
+            return map->fm_extents[0].fe_physical & ~(1ULL << 63);
+        }
+    }
+#else
+    (void)filename;
+#endif
+    return (1ULL << 63) | meta.ino;
+}
+
+typedef ThreadSafeQueue<HashJob, std::priority_queue<HashJob>> HashJobQueue;
+
+// Largest-first ordering only applies to files waiting in the queue, so it
+// is allowed to hold many more files than there are workers
+const size_t HASH_QUEUE_CAPACITY = 65536;
+
+// A file that could not be hashed, and why
+struct FailedFile {
     std::string filename;
-    while (work_queue.pop(filename)) {
+    std::string reason;
+};
+
+#ifdef cimg_version
+// Images and video frames are hashed at this size, as pHash does
+const int DCT_HASH_SIZE = 32;
+
+// pHash's DCT hash of a DCT_HASH_SIZE square image: the 8x8 lowest
+// frequencies (less the DC term), each bit set when its coefficient is
+// above their median
+template <typename T>
+ulong64 dct_low_frequency_hash(const CImg<T>& image) {
+    static const CImg<float>* dct = ph_dct_matrix(DCT_HASH_SIZE);
+    static const CImg<float> dct_transpose = dct->get_transpose();
+    CImg<float> coefficients = (*dct) * image * dct_transpose;
+    CImg<float> low = coefficients.crop(1, 1, 8, 8).unroll('x');
+    float median = low.median();
+    ulong64 hash = 0;
+    for (int j = 0; j < 64; ++j) {
+        if (low(j) > median) hash |= 1ULL << j;
+    }
+    return hash;
+}
+#endif // cimg_version
+
+// How video frames are picked for hashing. pHash decodes every frame and
+// keeps one every half second; the native hasher can do the same, or only
+// decode keyframes, or seek to one frame every few seconds.
+enum class VideoSampling { Frames, Keyframes, Interval };
+
+struct VideoHashOptions {
+    bool native = false;     // decode with FFmpeg here instead of ph_dct_videohash
+    VideoSampling sampling = VideoSampling::Frames;
+    double interval = 0;     // seconds between samples, for Interval
+    int decode_threads = 1;  // FFmpeg decoder threads per file
+};
+
+#ifdef PHASH_COMPARE_NATIVE_VIDEO
+const int VIDEO_FRAME_SIZE = DCT_HASH_SIZE;
+
+// Decodes the best video stream of a file into small grayscale frames
+class VideoFrameReader {
+public:
+    VideoFrameReader() = default;
+    VideoFrameReader(const VideoFrameReader&) = delete;
+    VideoFrameReader& operator=(const VideoFrameReader&) = delete;
+
+    ~VideoFrameReader() {
+        sws_freeContext(scaler);
+        av_frame_free(&decoded);
+        av_packet_free(&packet);
+        avcodec_free_context(&codec);
+        avformat_close_input(&format);
+    }
+
+    bool open(const std::string& filename, int threads) {
+        if (avformat_open_input(&format, filename.c_str(), nullptr, nullptr) < 0) return false;
+        if (avformat_find_stream_info(format, nullptr) < 0) return false;
+        stream = av_find_best_stream(format, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+        if (stream < 0) return false;
+        // The demuxer still reads other streams, but need not keep them
+        for (unsigned i = 0; i < format->nb_streams; ++i) {
+            if (static_cast<int>(i) != stream) format->streams[i]->discard = AVDISCARD_ALL;
+        }
+
+        AVStream* st = format->streams[stream];
+        const AVCodec* decoder = avcodec_find_decoder(st->codecpar->codec_id);
+        if (!decoder) return false;
+        codec = avcodec_alloc_context3(decoder);
+        if (!codec || avcodec_parameters_to_context(codec, st->codecpar) < 0) return false;
+        codec->thread_count = std::max(1, threads);
+        codec->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+        if (avcodec_open2(codec, decoder, nullptr) < 0) return false;
+
+        packet = av_packet_alloc();
+        decoded = av_frame_alloc();
+        time_base = av_q2d(st->time_base);
+        start_time = st->start_time != AV_NOPTS_VALUE ? st->start_time : 0;
+        return packet && decoded;
+    }
+
+    double frame_rate() const {
+        return av_q2d(av_guess_frame_rate(format, format->streams[stream], nullptr));
+    }
+
+    // Decode only keyframes from here on
+    void keyframes_only() {
+        keys_only = true;
+        codec->skip_frame = AVDISCARD_NONKEY;
+    }
+
+    // Decode the next frame into a VIDEO_FRAME_SIZE square grayscale image,
+    // with its time in seconds from the start of the stream. Returns false
+    // at the end of the stream or when the decoder fails.
+    bool next(CImg<uint8_t>& frame, double& seconds) {
+        for (;;) {
+            int ret = avcodec_receive_frame(codec, decoded);
+            if (ret == 0) {
+                bool scaled = scale(frame);
+                int64_t pts = decoded->best_effort_timestamp;
+                if (pts != AV_NOPTS_VALUE) position = pts;
+                seconds = (position != AV_NOPTS_VALUE ? position - start_time : 0) * time_base;
+                av_frame_unref(decoded);
+                return scaled;
+            }
+            if (ret != AVERROR(EAGAIN) || draining) return false;
+            if (av_read_frame(format, packet) < 0) {
+                // End of file: flush the frames the decoder still holds
+                draining = true;
+                avcodec_send_packet(codec, nullptr);
+                continue;
+            }
+            if (packet->stream_index == stream && (!keys_only || (packet->flags & AV_PKT_FLAG_KEY))) {
+                // A corrupt packet only costs its own frames
+                avcodec_send_packet(codec, packet);
+            }
+            av_packet_unref(packet);
+        }
+    }
+
+    // Jump ahead to the keyframe at or before `seconds`, if the demuxer's
+    // index has one past the current position; otherwise keep decoding
+    // forward, which is cheaper than seeking back to the same keyframe.
+    void skip_to(double seconds) {
+        if (draining) return;
+        AVStream* st = format->streams[stream];
+        int64_t target = start_time + static_cast<int64_t>(seconds / time_base);
+        int index = av_index_search_timestamp(st, target, AVSEEK_FLAG_BACKWARD);
+        if (index < 0) return;
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(58, 78, 100)
+        int64_t keyframe = avformat_index_get_entry(st, index)->timestamp;
+#else
+        int64_t keyframe = st->index_entries[index].timestamp;
+#endif
+        if (position != AV_NOPTS_VALUE && keyframe <= position) return;
+        if (av_seek_frame(format, stream, target, AVSEEK_FLAG_BACKWARD) < 0) return;
+        avcodec_flush_buffers(codec);
+    }
+
+private:
+    bool scale(CImg<uint8_t>& frame) {
+        scaler = sws_getCachedContext(scaler, decoded->width, decoded->height,
+                                      static_cast<AVPixelFormat>(decoded->format), VIDEO_FRAME_SIZE,
+                                      VIDEO_FRAME_SIZE, AV_PIX_FMT_GRAY8, SWS_BICUBIC, nullptr, nullptr, nullptr);
+        if (!scaler) return false;
+        frame.assign(VIDEO_FRAME_SIZE, VIDEO_FRAME_SIZE, 1, 1);
+        uint8_t* planes[4] = {frame.data(), nullptr, nullptr, nullptr};
+        int strides[4] = {VIDEO_FRAME_SIZE, 0, 0, 0};
+        sws_scale(scaler, decoded->data, decoded->linesize, 0, decoded->height, planes, strides);
+        return true;
+    }
+
+    AVFormatContext* format = nullptr;
+    AVCodecContext* codec = nullptr;
+    SwsContext* scaler = nullptr;
+    AVPacket* packet = nullptr;
+    AVFrame* decoded = nullptr;
+    int stream = -1;
+    double time_base = 0;
+    int64_t start_time = 0;
+    int64_t position = AV_NOPTS_VALUE;
+    bool keys_only = false;
+    bool draining = false;
+};
+
+// Pick one frame per shot from the sampled frames, as ph_dct_videohash
+// does: a shot boundary is a local maximum of the histogram difference
+// between neighbouring samples that clears both a global threshold (mean
+// plus three mean deviations over 50 samples either side) and a local one
+// (twice the runner-up within 10 samples). Each shot contributes its
+// steadiest frame, the one least different from the sample before it.
+std::vector<size_t> select_video_frames(const std::vector<CImg<uint8_t>>& samples) {
+    const int S = 10, L = 50;
+    const float alpha1 = 3, alpha2 = 2;
+    int n = static_cast<int>(samples.size());
+    std::vector<size_t> selected;
+    if (n < 3) {
+        for (int i = 0; i < n; ++i) selected.push_back(i);
+        return selected;
+    }
+
+    std::vector<float> dist(n, 0.0f);
+    CImg<float> prev(64, 1, 1, 1, 0);
+    for (int k = 0; k < n; ++k) {
+        CImg<float> hist = samples[k].get_histogram(64, 0, 255);
+        cimg_forX(hist, x) {
+            dist[k] += std::fabs(hist(x) - prev(x));
+        }
+        prev = hist;
+    }
+
+    std::vector<bool> boundary(n, false);
+    boundary[0] = boundary[n - 1] = true;
+    for (int k = 1; k < n - 1; ++k) {
+        int s_begin = std::max(k - S, 0), s_end = std::min(k + S, n - 1);
+        int l_begin = std::max(k - L, 0), l_end = std::min(k + L, n - 1);
+        float count = static_cast<float>(l_end - l_begin + 1);
+        float average = 0, deviation = 0;
+        for (int i = l_begin; i <= l_end; ++i) average += dist[i];
+        average /= count;
+        for (int i = l_begin; i <= l_end; ++i) deviation += std::fabs(average - dist[i]);
+        deviation /= count;
+        float global = average + alpha1 * deviation;
+
+        int max_pos = s_begin;
+        for (int i = s_begin; i <= s_end; ++i) {
+            if (dist[i] > dist[max_pos]) max_pos = i;
+        }
+        float second = 0;
+        for (int i = s_begin; i <= s_end; ++i) {
+            if (i != max_pos && dist[i] > second) second = dist[i];
+        }
+        float threshold = std::max(global, alpha2 * second);
+        boundary[k] = dist[k] == dist[max_pos] && dist[k] > threshold;
+    }
+
+    for (int start = 0; start < n - 1;) {
+        int end = start + 1;
+        while (end < n - 1 && !boundary[end]) ++end;
+        int min_pos = start + 1;
+        for (int i = start + 1; i < end; ++i) {
+            if (dist[i] < dist[min_pos]) min_pos = i;
+        }
+        selected.push_back(min_pos);
+        start = end;
+    }
+    return selected;
+}
+
+// pHash's frame hash: the DCT hash of the slightly blurred frame
+ulong64 video_frame_hash(CImg<uint8_t> frame) {
+    frame.blur(1.0);
+    return dct_low_frequency_hash(frame);
+}
+
+// Hash a video with FFmpeg directly: one decode pass that keeps only the
+// sampled frames, scaled down by swscale, then pHash's shot selection and
+// frame hash on those, so the result can be compared with hashes from
+// ph_dct_videohash. Returns a malloc'd hash array or nullptr.
+ulong64* native_video_hash(const std::string& filename, const VideoHashOptions& options, int& length) {
+    length = 0;
+    try {
+        VideoFrameReader reader;
+        if (!reader.open(filename, options.decode_threads)) return nullptr;
+
+        std::vector<CImg<uint8_t>> samples;
+        CImg<uint8_t> frame;
+        double seconds = 0;
+        if (options.sampling == VideoSampling::Frames) {
+            // Every half second of frames, counted like pHash does
+            double rate = reader.frame_rate();
+            if (!(rate > 0)) return nullptr;
+            long step = std::max(1L, std::lround(0.5 * rate));
+            for (long n = 0; reader.next(frame, seconds); ++n) {
+                if (n % step == 0) samples.push_back(frame);
+            }
+        } else if (options.sampling == VideoSampling::Keyframes) {
+            reader.keyframes_only();
+            while (reader.next(frame, seconds)) {
+                samples.push_back(frame);
+            }
+        } else {
+            // The first frame at or after each interval mark
+            double due = 0;
+            while (reader.next(frame, seconds)) {
+                if (seconds < due) continue;
+                samples.push_back(frame);
+                due = (std::floor(seconds / options.interval) + 1) * options.interval;
+                reader.skip_to(due);
+            }
+        }
+        if (samples.empty()) return nullptr;
+
+        std::vector<size_t> selected = select_video_frames(samples);
+        ulong64* hash = (ulong64*)malloc(selected.size() * sizeof(ulong64));
+        for (size_t i = 0; i < selected.size(); ++i) {
+            hash[i] = video_frame_hash(samples[selected[i]]);
+        }
+        length = static_cast<int>(selected.size());
+        return hash;
+    } catch (const std::exception&) {
+        return nullptr;
+    }
+}
+#endif // PHASH_COMPARE_NATIVE_VIDEO
+
+// Hash a video with pHash or the native hasher. Returns a malloc'd hash
+// array or nullptr.
+ulong64* video_hash(const std::string& filename, const VideoHashOptions& options, int& length) {
+#ifdef PHASH_COMPARE_NATIVE_VIDEO
+    if (options.native) {
+        return native_video_hash(filename, options, length);
+    }
+#else
+    (void)options;
+#endif
+    ulong64* hash = ph_dct_videohash(filename.c_str(), length);
+    if (hash && length <= 0) {
+        free(hash);
+        hash = nullptr;
+    }
+    return hash;
+}
+
+#ifdef PHASH_COMPARE_SCALED_IMAGES
+// Scaled decoding keeps at least this many pixels on the short side, so
+// each of the 32 samples per row still averages a few decoded pixels
+const int IMAGE_DECODE_MIN_SIDE = 256;
+
+// Largest of 1/8, 1/4 and 1/2 (libjpeg's DCT scaling factors, used for the
+// other formats too so they hash alike) that keeps IMAGE_DECODE_MIN_SIDE
+int image_decode_scale(uint32_t width, uint32_t height) {
+    uint32_t side = std::min(width, height);
+    for (int scale = 8; scale > 1; scale /= 2) {
+        if (side / scale >= IMAGE_DECODE_MIN_SIDE) return scale;
+    }
+    return 1;
+}
+
+// A grayscale image decoded at reduced size: each pixel covers `scale` x
+// `scale` pixels of the full-resolution image
+struct ScaledGray {
+    uint32_t width = 0;  // full-resolution size
+    uint32_t height = 0;
+    int scale = 1;
+    uint32_t columns = 0;
+    uint32_t rows = 0;
+    std::vector<float> pixels;
+
+    void reset(uint32_t w, uint32_t h, int s) {
+        width = w;
+        height = h;
+        scale = s;
+        columns = (w + s - 1) / s;
+        rows = (h + s - 1) / s;
+        pixels.assign(static_cast<size_t>(columns) * rows, 0.0f);
+    }
+
+    // For decoders without scaling: sum full-resolution row y into its
+    // cells, then divide() once every row is in
+    void add_row(uint32_t y, const uint8_t* luma) {
+        float* out = &pixels[static_cast<size_t>(y / scale) * columns];
+        for (uint32_t x = 0; x < width; ++x) {
+            out[x / scale] += luma[x];
+        }
+    }
+
+    void divide() {
+        for (uint32_t r = 0; r < rows; ++r) {
+            uint32_t cell_height = std::min<uint32_t>(scale, height - r * scale);
+            for (uint32_t c = 0; c < columns; ++c) {
+                uint32_t cell_width = std::min<uint32_t>(scale, width - c * scale);
+                pixels[static_cast<size_t>(r) * columns + c] /= static_cast<float>(cell_width * cell_height);
+            }
+        }
+    }
+};
+
+// Luma of a row of 8-bit RGB pixels, with CImg's RGBtoYCbCr as pHash uses it
+void rgb_row_to_luma(const uint8_t* rgb, uint32_t width, uint8_t* luma) {
+    for (uint32_t x = 0; x < width; ++x, rgb += 3) {
+        float y = (66.0f * rgb[0] + 129.0f * rgb[1] + 25.0f * rgb[2] + 128.0f) / 256.0f + 16.0f;
+        luma[x] = static_cast<uint8_t>(std::min(y, 255.0f));
+    }
+}
+
+#ifdef PHASH_COMPARE_WITH_JPEG
+struct JpegError {
+    jpeg_error_mgr manager;
+    jmp_buf jump;
+};
+
+void jpeg_error_exit(j_common_ptr cinfo) {
+    longjmp(reinterpret_cast<JpegError*>(cinfo->err)->jump, 1);
+}
+
+void jpeg_no_message(j_common_ptr) {}
+
+// Decode a JPEG to grayscale at 1/2, 1/4 or 1/8 size, with libjpeg
+// computing only the low DCT frequencies of each block and skipping the
+// colour components altogether
+bool decode_jpeg_scaled(FILE* file, ScaledGray& image) {
+    jpeg_decompress_struct cinfo;
+    JpegError error;
+    std::vector<JSAMPLE> row;
+    cinfo.err = jpeg_std_error(&error.manager);
+    error.manager.error_exit = jpeg_error_exit;
+    error.manager.output_message = jpeg_no_message;
+    if (setjmp(error.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_stdio_src(&cinfo, file);
+    jpeg_read_header(&cinfo, TRUE);
+    // pHash hashes four-channel images oddly; leave CMYK to it
+    if (cinfo.jpeg_color_space == JCS_CMYK || cinfo.jpeg_color_space == JCS_YCCK) {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+
+    int scale = image_decode_scale(cinfo.image_width, cinfo.image_height);
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = scale;
+    cinfo.out_color_space = JCS_GRAYSCALE;
+    cinfo.dct_method = JDCT_ISLOW;
+    jpeg_start_decompress(&cinfo);
+    image.reset(cinfo.image_width, cinfo.image_height, scale);
+    if (cinfo.output_width != image.columns || cinfo.output_height != image.rows) {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+    row.resize(cinfo.output_width);
+    while (cinfo.output_scanline < cinfo.output_height) {
+        float* out = &image.pixels[static_cast<size_t>(cinfo.output_scanline) * image.columns];
+        JSAMPROW rows[1] = {row.data()};
+        jpeg_read_scanlines(&cinfo, rows, 1);
+        std::copy(row.begin(), row.end(), out);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return true;
+}
+#endif // PHASH_COMPARE_WITH_JPEG
+
+#ifdef PHASH_COMPARE_WITH_PNG
+// Decode a PNG a row at a time into a reduced image, so the full-size
+// image is never held in memory. Interlaced, 16-bit and colour images with
+// transparency are left to pHash.
+bool decode_png_scaled(FILE* file, ScaledGray& image) {
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    png_infop info = png ? png_create_info_struct(png) : nullptr;
+    std::vector<uint8_t> row;
+    std::vector<uint8_t> luma;
+    if (!info) {
+        png_destroy_read_struct(&png, nullptr, nullptr);
+        return false;
+    }
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_read_struct(&png, &info, nullptr);
+        return false;
+    }
+    png_set_error_fn(png, nullptr, [](png_structp p, png_const_charp) { png_longjmp(p, 1); },
+                     [](png_structp, png_const_charp) {});
+    png_init_io(png, file);
+    png_read_info(png, info);
+
+    uint32_t width = png_get_image_width(png, info);
+    uint32_t height = png_get_image_height(png, info);
+    int bit_depth = png_get_bit_depth(png, info);
+    int color_type = png_get_color_type(png, info);
+    bool color = color_type & PNG_COLOR_MASK_COLOR;
+    bool alpha = (color_type & PNG_COLOR_MASK_ALPHA) || png_get_valid(png, info, PNG_INFO_tRNS);
+    if (bit_depth > 8 || png_get_interlace_type(png, info) != PNG_INTERLACE_NONE || (color && alpha)) {
+        png_destroy_read_struct(&png, &info, nullptr);
+        return false;
+    }
+    if (color_type == PNG_COLOR_TYPE_PALETTE) png_set_palette_to_rgb(png);
+    if (!color && bit_depth < 8) png_set_expand_gray_1_2_4_to_8(png);
+    png_set_strip_alpha(png);
+    png_read_update_info(png, info);
+    int channels = png_get_channels(png, info);
+    if (channels != 1 && channels != 3) {
+        png_destroy_read_struct(&png, &info, nullptr);
+        return false;
+    }
+
+    image.reset(width, height, image_decode_scale(width, height));
+    row.resize(png_get_rowbytes(png, info));
+    luma.resize(width);
+    for (uint32_t y = 0; y < height; ++y) {
+        png_read_row(png, row.data(), nullptr);
+        if (channels == 3) {
+            rgb_row_to_luma(row.data(), width, luma.data());
+            image.add_row(y, luma.data());
+        } else {
+            image.add_row(y, row.data());
+        }
+    }
+    png_destroy_read_struct(&png, &info, nullptr);
+    image.divide();
+    return true;
+}
+#endif // PHASH_COMPARE_WITH_PNG
+
+#ifdef PHASH_COMPARE_WITH_TIFF
+// Decode a stripped 8-bit grayscale or RGB TIFF a scanline at a time into
+// a reduced image; tiled, planar and other layouts are left to pHash
+bool decode_tiff_scaled(const std::string& filename, ScaledGray& image) {
+    static bool quiet = (TIFFSetWarningHandler(nullptr), TIFFSetErrorHandler(nullptr), true);
+    (void)quiet;
+    TIFF* tif = TIFFOpen(filename.c_str(), "r");
+    if (!tif) return false;
+    uint32_t width = 0, height = 0;
+    uint16_t bits = 0, samples = 0, planar = 0, photometric = 0;
+    TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width);
+    TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &height);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_BITSPERSAMPLE, &bits);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL, &samples);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_PLANARCONFIG, &planar);
+    TIFFGetField(tif, TIFFTAG_PHOTOMETRIC, &photometric);
+    bool gray = samples == 1 && (photometric == PHOTOMETRIC_MINISBLACK || photometric == PHOTOMETRIC_MINISWHITE);
+    bool rgb = samples == 3 && photometric == PHOTOMETRIC_RGB;
+    if (TIFFIsTiled(tif) || bits != 8 || planar != PLANARCONFIG_CONTIG || !(gray || rgb) || width == 0 || height == 0) {
+        TIFFClose(tif);
+        return false;
+    }
+
+    image.reset(width, height, image_decode_scale(width, height));
+    std::vector<uint8_t> row(TIFFScanlineSize(tif));
+    std::vector<uint8_t> luma(width);
+    bool ok = row.size() >= static_cast<size_t>(width) * samples;
+    for (uint32_t y = 0; ok && y < height; ++y) {
+        ok = TIFFReadScanline(tif, row.data(), y) >= 0;
+        if (!ok) break;
+        if (rgb) {
+            rgb_row_to_luma(row.data(), width, luma.data());
+            image.add_row(y, luma.data());
+        } else {
+            image.add_row(y, row.data());
+        }
+    }
+    TIFFClose(tif);
+    if (ok) image.divide();
+    return ok;
+}
+#endif // PHASH_COMPARE_WITH_TIFF
+
+// ph_dct_imagehash's hash of a reduced image. pHash blurs the full image
+// with a 7x7 mean filter and takes the nearest pixel for each of the 32x32
+// samples; here the reduced pixels already average `scale` x `scale`
+// pixels, and a mean over the remaining 7 / scale of them stands in for
+// the rest of the filter.
+ulong64 scaled_gray_hash(const ScaledGray& image) {
+    int window = std::max(1, static_cast<int>(std::lround(7.0 / image.scale)));
+    int before = window / 2;
+    CImg<float> samples(DCT_HASH_SIZE, DCT_HASH_SIZE, 1, 1);
+    for (int sy = 0; sy < DCT_HASH_SIZE; ++sy) {
+        int y = static_cast<int>(static_cast<uint64_t>(sy) * image.height / DCT_HASH_SIZE / image.scale);
+        for (int sx = 0; sx < DCT_HASH_SIZE; ++sx) {
+            int x = static_cast<int>(static_cast<uint64_t>(sx) * image.width / DCT_HASH_SIZE / image.scale);
+            float sum = 0;
+            for (int dy = 0; dy < window; ++dy) {
+                int row = std::min(std::max(y - before + dy, 0), static_cast<int>(image.rows) - 1);
+                const float* pixels = &image.pixels[static_cast<size_t>(row) * image.columns];
+                for (int dx = 0; dx < window; ++dx) {
+                    sum += pixels[std::min(std::max(x - before + dx, 0), static_cast<int>(image.columns) - 1)];
+                }
+            }
+            samples(sx, sy) = sum / (window * window);
+        }
+    }
+    return dct_low_frequency_hash(samples);
+}
+
+// Hash a JPEG, PNG or TIFF decoded at reduced size, picking the decoder by
+// the file's signature. Returns false for anything the scaled decoders do
+// not handle, for the caller to hash with pHash instead.
+bool scaled_image_hash(const std::string& filename, ulong64& hash) {
+    FILE* file = fopen(filename.c_str(), "rbe");
+    if (!file) return false;
+    unsigned char magic[4] = {0, 0, 0, 0};
+    size_t got = fread(magic, 1, sizeof(magic), file);
+    rewind(file);
+
+    ScaledGray image;
+    bool decoded = false;
+    if (got >= 3 && magic[0] == 0xFF && magic[1] == 0xD8 && magic[2] == 0xFF) {
+#ifdef PHASH_COMPARE_WITH_JPEG
+        decoded = decode_jpeg_scaled(file, image);
+#endif
+    } else if (got == 4 && std::memcmp(magic, "\x89PNG", 4) == 0) {
+#ifdef PHASH_COMPARE_WITH_PNG
+        decoded = decode_png_scaled(file, image);
+#endif
+    } else if (got == 4 && (std::memcmp(magic, "II*\0", 4) == 0 || std::memcmp(magic, "MM\0*", 4) == 0)) {
+#ifdef PHASH_COMPARE_WITH_TIFF
+        decoded = decode_tiff_scaled(filename, image);
+#endif
+    }
+    fclose(file);
+    if (!decoded) return false;
+    hash = scaled_gray_hash(image);
+    return true;
+}
+#endif // PHASH_COMPARE_SCALED_IMAGES
+
+// Hash an image with ph_dct_imagehash or, when `scaled` is set and the
+// format allows it, from a reduced-size decode. Returns 0 on success like
+// ph_dct_imagehash.
+int image_hash(const std::string& filename, bool scaled, ulong64& hash) {
+#ifdef PHASH_COMPARE_SCALED_IMAGES
+    if (scaled && scaled_image_hash(filename, hash)) {
+        return 0;
+    }
+#else
+    (void)scaled;
+#endif
+    return ph_dct_imagehash(filename.c_str(), hash);
+}
+
+// Settings shared by the hash workers
+struct HashWorkerOptions {
+    int file_timeout = 0; // seconds per file, 0 for no limit
+    std::string self_exe; // this binary, for isolated hashing
+    bool quiet = false;   // no per-file progress lines
+    bool scaled_images = false; // decode images at reduced size where possible
+    VideoHashOptions video;
+};
+
+// What the hash workers did, merged from each worker when it finishes
+struct HashStats {
+    std::mutex mutex;
+    LatencyHistogram latency;
+    double cpu = 0;     // worker thread CPU seconds
+    uint64_t files = 0; // hashed successfully
+    uint64_t bytes = 0; // size of those files
+
+    void merge(const LatencyHistogram& l, double c, uint64_t f, uint64_t b) {
+        std::lock_guard<std::mutex> lock(mutex);
+        latency += l;
+        cpu += c;
+        files += f;
+        bytes += b;
+    }
+};
+
+// CPUs this process can use: the cores in its affinity mask, capped by a
+// cgroup CPU quota (cgroup v2 cpu.max, or v1 cpu.cfs_quota_us) rounded up
+struct CpuLimit {
+    int available = 1; // cores in the affinity mask
+    double quota = 0;  // cgroup quota in cores, 0 if unlimited
+    int cores = 1;     // what to plan for
+};
+
+// Quota in cores from a cgroup v2 cpu.max ("max 100000" or "quota period")
+// or a v1 directory's cfs files; 0 if there is none
+double read_cgroup_quota(const std::string& dir, bool v2) {
+    long long quota = -1, period = 0;
+    if (v2) {
+        std::ifstream file(dir + "/cpu.max");
+        std::string limit;
+        if (!(file >> limit >> period) || limit == "max") return 0;
+        quota = std::atoll(limit.c_str());
+    } else {
+        std::ifstream quota_file(dir + "/cpu.cfs_quota_us");
+        std::ifstream period_file(dir + "/cpu.cfs_period_us");
+        if (!(quota_file >> quota) || !(period_file >> period)) return 0;
+    }
+    return quota > 0 && period > 0 ? static_cast<double>(quota) / period : 0;
+}
+
+CpuLimit detect_cpu_limit() {
+    CpuLimit limit;
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        limit.available = std::max(1, CPU_COUNT(&set));
+    } else {
+        limit.available = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // The quota of the process's own cgroup and of every parent applies;
+    // the smallest one is the limit
+    std::ifstream cgroups("/proc/self/cgroup");
+    std::string line;
+    while (std::getline(cgroups, line)) {
+        size_t first = line.find(':');
+        size_t second = line.find(':', first + 1);
+        if (first == std::string::npos || second == std::string::npos) continue;
+        std::string controllers = line.substr(first + 1, second - first - 1);
+        std::string path = line.substr(second + 1);
+        std::string root;
+        bool v2 = controllers.empty();
+        if (v2) {
+            root = "/sys/fs/cgroup";
+        } else {
+            std::istringstream names(controllers);
+            std::string name;
+            bool cpu = false;
+            while (std::getline(names, name, ',')) cpu = cpu || name == "cpu";
+            if (!cpu) continue;
+            root = std::filesystem::exists("/sys/fs/cgroup/" + controllers) ? "/sys/fs/cgroup/" + controllers
+                                                                              : "/sys/fs/cgroup/cpu";
+        }
+        for (;;) {
+            // Inside a container the recorded path may not exist in its
+            // own view of the hierarchy; the root then holds its limit
+            std::string dir = root + (path == "/" ? "" : path);
+            double quota = std::filesystem::exists(dir) ? read_cgroup_quota(dir, v2) : 0;
+            if (quota > 0 && (limit.quota == 0 || quota < limit.quota)) limit.quota = quota;
+            if (path.empty() || path == "/") break;
+            size_t slash = path.rfind('/');
+            path = slash == 0 ? "/" : path.substr(0, slash);
+        }
+    }
+
+    limit.cores = limit.available;
+    if (limit.quota > 0) {
+        limit.cores = std::max(1, std::min(limit.cores, static_cast<int>(std::ceil(limit.quota - 1e-9))));
+    }
+    return limit;
+}
+
+// Windows over which adaptive concurrency measures throughput: at least this
+// long, and until each active worker has finished a couple of files, but
+// never longer than the maximum
+const double CONCURRENCY_WINDOW = 2.0;
+const double CONCURRENCY_MAX_WINDOW = 30.0;
+// A step must beat the best level by this much to be kept
+const double CONCURRENCY_GAIN = 0.05;
+// Windows to stay at a settled level before probing its neighbours again
+const int CONCURRENCY_HOLD = 5;
+
+// Decides how many hash workers may take files. With a fixed -j every
+// worker is always active. With -j auto more workers are started than
+// there are cores and a controller thread hill-climbs the active count:
+// it measures throughput at one level, steps up or down by one worker,
+// keeps the step if it was clearly faster and reverses direction if not.
+// When neither neighbour helps it holds the level for a while and then
+// probes again, following changes in the mix of files. Throughput is taken
+// in bytes hashed per second rather than files per second, since the
+// largest-first queue moves from large to small files during a run.
+class ConcurrencyController {
+public:
+    explicit ConcurrencyController(size_t workers) : workers(workers), active(workers), best(workers) {}
+
+    ~ConcurrencyController() { stop(); }
+
+    // Start adapting with initial workers active, before the workers start
+    void start(size_t initial) {
+        adaptive = true;
+        active = best = lowest = highest = std::max<size_t>(1, std::min(initial, workers));
+        thread = std::thread(&ConcurrencyController::run, this);
+    }
+
+    // Called by worker index before it takes a file: waits while the worker
+    // is not among the active ones
+    void admit(size_t index) {
+        if (!adaptive) return;
+        std::unique_lock<std::mutex> lock(mutex);
+        admitted.wait(lock, [&] { return index < active || finished; });
+    }
+
+    // Called by a worker after each file it processed
+    void completed(uint64_t size) {
+        files.fetch_add(1, std::memory_order_relaxed);
+        bytes.fetch_add(size, std::memory_order_relaxed);
+    }
+
+    // Called by a worker that found the queue drained: parked workers are
+    // let through so they find it drained too and exit
+    void finish() {
+        std::lock_guard<std::mutex> lock(mutex);
+        finished = true;
+        admitted.notify_all();
+        changed.notify_all();
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        changed.notify_all();
+        if (thread.joinable()) thread.join();
+    }
+
+    // Level the controller settled on, and the range it tried
+    size_t settled() const { return best; }
+    size_t lowest_tried() const { return lowest; }
+    size_t highest_tried() const { return highest; }
+
+private:
+    size_t workers;
+    bool adaptive = false;
+    size_t active;
+    size_t best;
+    size_t lowest = 0;
+    size_t highest = 0;
+    bool finished = false;
+    bool stopping = false;
+    std::atomic<uint64_t> files{0};
+    std::atomic<uint64_t> bytes{0};
+    std::mutex mutex;
+    std::condition_variable admitted;
+    std::condition_variable changed;
+    std::thread thread;
+
+    void set_active(size_t level) {
+        active = level;
+        lowest = std::min(lowest, level);
+        highest = std::max(highest, level);
+        admitted.notify_all();
+    }
+
+    // Throughput over the next window at the current level, or -1 once the
+    // run is over
+    double measure(std::unique_lock<std::mutex>& lock) {
+        uint64_t files_before = files.load(std::memory_order_relaxed);
+        uint64_t bytes_before = bytes.load(std::memory_order_relaxed);
+        double started = wall_seconds();
+        for (;;) {
+            changed.wait_for(lock, std::chrono::duration<double>(CONCURRENCY_WINDOW), [&] { return stopping || finished; });
+            if (stopping || finished) return -1;
+            double elapsed = wall_seconds() - started;
+            if (elapsed >= CONCURRENCY_MAX_WINDOW ||
+                (elapsed >= CONCURRENCY_WINDOW && files.load(std::memory_order_relaxed) - files_before >= 2 * active)) {
+                return (bytes.load(std::memory_order_relaxed) - bytes_before) / elapsed;
+            }
+        }
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        double best_rate = measure(lock);
+        int direction = 1;
+        int failures = 0;
+        while (best_rate >= 0) {
+            size_t candidate = direction > 0 ? std::min(workers, best + 1) : std::max<size_t>(1, best - 1);
+            double rate = 0;
+            if (candidate != best) {
+                set_active(candidate);
+                rate = measure(lock);
+                if (rate < 0) break;
+            }
+            if (candidate != best && rate > best_rate * (1 + CONCURRENCY_GAIN)) {
+                best = candidate;
+                best_rate = rate;
+                failures = 0;
+                continue;
+            }
+            set_active(best);
+            direction = -direction;
+            if (++failures < 2) continue;
+            // Neither neighbour is faster: stay, then measure afresh
+            for (int w = 0; w < CONCURRENCY_HOLD && best_rate >= 0; ++w) {
+                best_rate = measure(lock);
+            }
+            failures = 0;
+        }
+    }
+};
+
+// Prefetches files for the hash workers (--readahead). A thread takes the
+// jobs from the scan's queue in disk order, asks the kernel to read each
+// file into the page cache with posix_fadvise(WILLNEED), and passes it on
+// to the queue the workers take from. That queue holds at most `files`
+// prefetched files, and the files prefetched but not yet hashed stay under
+// max_bytes (a larger file goes alone, prefetched up to max_bytes), so
+// readahead keeps ahead of the workers without evicting its own reads.
+class ReadaheadStage {
+public:
+    ReadaheadStage(HashJobQueue& pending, size_t files, uint64_t max_bytes)
+        : pending(pending), ready(std::max<size_t>(1, files)), max_bytes(max_bytes) {}
+
+    ~ReadaheadStage() { join(); }
+
+    // Queue of prefetched files, for the workers
+    HashJobQueue& queue() { return ready; }
+
+    void start() {
+        active = true;
+        thread = std::thread(&ReadaheadStage::run, this);
+    }
+
+    // Returns once the pending queue is closed and drained
+    void join() {
+        if (thread.joinable()) thread.join();
+    }
+
+    // Called by a worker when it is done with a file it took from queue()
+    void done(uint64_t size) {
+        if (!active) return;
+        std::lock_guard<std::mutex> lock(mutex);
+        in_flight -= std::min(in_flight, std::min(size, max_bytes));
+        budget.notify_one();
+    }
+
+    uint64_t files_prefetched() const { return files; }
+    uint64_t bytes_prefetched() const { return bytes; }
+
+private:
+    HashJobQueue& pending;
+    HashJobQueue ready;
+    uint64_t max_bytes;
+    bool active = false;
+    uint64_t in_flight = 0;
+    uint64_t files = 0;
+    uint64_t bytes = 0;
+    std::mutex mutex;
+    std::condition_variable budget;
+    std::thread thread;
+
+    void run() {
+        HashJob job;
+        while (pending.wait_and_pop(job)) {
+            uint64_t length = std::min(job.meta.size, max_bytes);
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                budget.wait(lock, [&] { return in_flight == 0 || in_flight + length <= max_bytes; });
+                in_flight += length;
+            }
+            int fd = open_regular_file(job.filename);
+            if (fd >= 0) {
+                if (posix_fadvise(fd, 0, static_cast<off_t>(length), POSIX_FADV_WILLNEED) == 0) {
+                    ++files;
+                    bytes += length;
+                }
+                close(fd);
+            }
+            ready.push(std::move(job));
+        }
+        ready.close();
+    }
+};
+
+// Hash one file in a child process (this binary with --hash-one) so it can
+// be abandoned when it runs past its time budget: pHash offers no way to
+// cancel a decode in progress. Returns a malloc'd hash array, or nullptr
+// with timed_out telling a timeout apart from a failed hash.
+ulong64* hash_file_isolated(const std::string& filename, bool image_mode, const HashWorkerOptions& options,
+                            int& length, bool& timed_out) {
+    length = 0;
+    timed_out = false;
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) return nullptr;
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+    std::vector<std::string> args = {options.self_exe, image_mode ? "-i" : "-v"};
+    if (image_mode && options.scaled_images) {
+        args.insert(args.end(), {"--image-hash", "scaled"});
+    }
+    if (!image_mode && options.video.native) {
+        const VideoHashOptions& video = options.video;
+        args.insert(args.end(), {"--video-hash", "native", "--decode-threads", std::to_string(video.decode_threads),
+                                 "--video-sample"});
+        if (video.sampling == VideoSampling::Interval) {
+            std::ostringstream interval;
+            interval << video.interval;
+            args.push_back(interval.str());
+        } else {
+            args.push_back(video.sampling == VideoSampling::Keyframes ? "keyframes" : "frames");
+        }
+    }
+    args.insert(args.end(), {"--hash-one", filename});
+    std::vector<char*> child_argv;
+    for (auto& arg : args) {
+        child_argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    child_argv.push_back(nullptr);
+    pid_t pid;
+    int spawned = posix_spawn(&pid, options.self_exe.c_str(), &actions, nullptr, child_argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[1]);
+    if (spawned != 0) {
+        close(fds[0]);
+        return nullptr;
+    }
+
+    std::string output;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(options.file_timeout);
+    for (;;) {
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+        if (remaining <= 0) {
+            timed_out = true;
+            break;
+        }
+        struct pollfd pfd = {fds[0], POLLIN, 0};
+        int ready = poll(&pfd, 1, static_cast<int>(remaining));
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready <= 0) continue;
+        char buf[4096];
+        ssize_t n = read(fds[0], buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        output.append(buf, n);
+    }
+    close(fds[0]);
+    if (timed_out) {
+        kill(pid, SIGKILL);
+    }
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+    if (timed_out || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return nullptr;
+    }
+    return hex_to_hash(output, length);
+}
+
+// Hash one file, in this process or, with a time budget, in a child
+// process. Returns a malloc'd hash array (a single block for images) or
+// nullptr, with timed_out set when the budget ran out.
+ulong64* compute_file_hash(const std::string& filename, bool image_mode, const HashWorkerOptions& options,
+                           int& length, bool& timed_out) {
+    length = 0;
+    timed_out = false;
+    if (options.file_timeout > 0) {
+        ulong64* hash = hash_file_isolated(filename, image_mode, options, length, timed_out);
+        if (hash && image_mode && length != 1) {
+            free(hash);
+            hash = nullptr;
+        }
+        return hash;
+    }
+    if (!image_mode) {
+        return video_hash(filename, options.video, length);
+    }
+    ulong64 hash;
+    int result = image_hash(filename, options.scaled_images, hash);
+    if (result != 0 || hash == 0) {
+        return nullptr;
+    }
+    // For images, we create a single-element hash array
+    ulong64* hash_array = (ulong64*)malloc(sizeof(ulong64));
+    hash_array[0] = hash;
+    length = 1;
+    return hash_array;
+}
+
+// Worker thread function for image or video hashing
+void hash_worker(HashJobQueue& work_queue, 
+                 ThreadSafeVector<VideoHash>& results,
+                 ThreadSafeVector<FailedFile>& failures,
+                 const HashWorkerOptions& options,
+                 bool image_mode,
+                 HashStats& stats,
+                 std::mutex& cerr_mutex,
+                 ReadaheadStage& readahead,
+                 ConcurrencyController& concurrency,
+                 size_t index) {
+    const char* kind = image_mode ? "image" : "video";
+    LatencyHistogram latency;
+    uint64_t files = 0;
+    uint64_t bytes = 0;
+    double cpu_start = thread_cpu_seconds();
+    HashJob job;
+    for (;;) {
+        concurrency.admit(index);
+        if (!work_queue.wait_and_pop(job)) break;
+        const std::string& filename = job.filename;
+        int length = 0;
+        bool timed_out = false;
+        double started = wall_seconds();
+        ulong64* hash = compute_file_hash(filename, image_mode, options, length, timed_out);
+        latency.add(wall_seconds() - started);
+        concurrency.completed(job.meta.size);
+        readahead.done(job.meta.size);
+        if (!hash) {
+            failures.push_back({filename, timed_out ? "timeout" : "failed"});
+            std::lock_guard<std::mutex> lock(cerr_mutex);
+            if (timed_out) {
+                std::cerr << "Abandoned " << kind << " hash for " << filename << " after " << options.file_timeout << "s" << std::endl;
+            } else {
+                std::cerr << "Failed to compute " << kind << " hash for " << filename << std::endl;
+            }
+            continue;
+        }
+        
+        results.push_back(VideoHash(filename, hash, length, job.meta));
+        ++files;
+        bytes += job.meta.size;
+        
+        if (!options.quiet) {
+            std::lock_guard<std::mutex> lock(cerr_mutex);
+            std::cerr << "Computed " << kind << " hash for " << filename << std::endl;
+        }
+    }
+    concurrency.finish();
+    stats.merge(latency, thread_cpu_seconds() - cpu_start, files, bytes);
+}
+
+// Saves the hashes workers have computed so far in batches, once `every`
+// new hashes are waiting or `interval` seconds have passed, so a run that
+// is killed only loses the files hashed since the last checkpoint.
+class CheckpointWriter {
+public:
+    CheckpointWriter(const std::string& database, DbFormat new_format, const ThreadSafeVector<VideoHash>& results,
+                     size_t every, int interval, std::mutex& cerr_mutex)
+        : database(database), new_format(new_format), results(results), every(every), interval(interval),
+          cerr_mutex(cerr_mutex) {}
+
+    void start() {
+        thread = std::thread(&CheckpointWriter::run, this);
+    }
+
+    // Stop without a final checkpoint: the caller saves whatever is left
+    void stop() {
+        if (!thread.joinable()) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        condition.notify_one();
+        thread.join();
+    }
+
+    // Number of results, from the front, that are already on disk
+    size_t saved() const {
+        return written;
+    }
+
+    // Time spent writing checkpoints
+    const StageTime& time() const {
+        return write_time;
+    }
+
+private:
+    void run() {
+        auto last = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping) {
+            condition.wait_for(lock, std::chrono::seconds(1));
+            if (stopping) break;
+            size_t pending = results.size() - written;
+            auto now = std::chrono::steady_clock::now();
+            bool due = (every > 0 && pending >= every) ||
+                       (interval > 0 && now - last >= std::chrono::seconds(interval));
+            if (pending == 0 || !due) continue;
+
+            std::vector<VideoHash> batch = results.get_from(written);
+            StageClock clock(write_time, true);
+            std::string records;
+            for (const auto& vh : batch) {
+                records += format_text_record(vh.filename, vh.hash, vh.length, vh.meta);
+            }
+            if (!checkpoint_hashes(database, records, new_format)) continue;
+            clock.stop();
+            written += batch.size();
+            last = now;
+            std::lock_guard<std::mutex> cerr_lock(cerr_mutex);
+            std::cerr << "Checkpointed " << batch.size() << " hashes to " << database << std::endl;
+        }
+    }
+
+    std::string database;
+    DbFormat new_format;
+    const ThreadSafeVector<VideoHash>& results;
+    size_t every;
+    int interval;
+    std::mutex& cerr_mutex;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool stopping = false;
+    size_t written = 0;
+    StageTime write_time;
+};
+
+// Hash a single file and print it as hex on stdout: the child side of
+// hash_file_isolated
+int hash_one_file(const std::string& filename, bool image_mode, const HashWorkerOptions& options) {
+    if (image_mode) {
+        ulong64 hash;
+        if (image_hash(filename, options.scaled_images, hash) != 0 || hash == 0) {
+            return 1;
+        }
+        std::cout << hash_to_hex(&hash, 1) << std::endl;
+        return 0;
+    }
+    int length = 0;
+    ulong64* hash = video_hash(filename, options.video, length);
+    if (!hash) {
+        return 1;
+    }
+    std::cout << hash_to_hex(hash, length) << std::endl;
+    free(hash);
+    return 0;
+}
+
+// 64-bit hash of a byte range for telling file contents apart (not
+// cryptographic): four multiply-rotate lanes over 8-byte words, so it runs
+// at memory speed. Chunks of one stream are chained through seed.
+uint64_t content_hash(const unsigned char* data, size_t size, uint64_t seed) {
+    const uint64_t k1 = 0x9e3779b97f4a7c15ULL, k2 = 0xc2b2ae3d27d4eb4fULL;
+    uint64_t lanes[4] = {seed ^ k1, seed ^ k2, seed + k1, seed - k2};
+    auto round = [&](uint64_t lane, uint64_t word) {
+        lane += word * k2;
+        lane = (lane << 31) | (lane >> 33);
+        return lane * k1;
+    };
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        for (int l = 0; l < 4; ++l) {
+            uint64_t word;
+            std::memcpy(&word, data + i + 8 * l, 8);
+            lanes[l] = round(lanes[l], word);
+        }
+    }
+    uint64_t h = size;
+    for (int l = 0; l < 4; ++l) {
+        h = round(h ^ lanes[l], k1);
+    }
+    for (; i < size; ++i) {
+        h = round(h, data[i]);
+    }
+    h ^= h >> 33;
+    h *= k2;
+    h ^= h >> 29;
+    return h;
+}
+
+// Finds files that are byte-identical to an earlier file of the run, so
+// only one copy of each is hashed. The first file of a size is only
+// remembered; once a second one turns up, files of that size are keyed by
+// a hash of three sampled blocks (start, middle, end) and the size, and a
+// file is compared byte by byte with the earlier files under its key, which
+// usually is a single one. Each file's sample is read at most once.
+class IdenticalFileFinder {
+public:
+    // Remember a file that can be matched against later, without looking
+    // for an earlier copy of it (files already hashed, for example)
+    void add(const std::string& file, uint64_t size) {
+        if (size == 0) return;
+        uint64_t sample;
+        if (keyed(file, size, sample)) {
+            by_sample[sample].push_back(candidates.size());
+            candidates.push_back({file, size});
+        }
+    }
+
+    // The path of an earlier file with the same contents (valid until the
+    // next call), or nullptr after remembering this one for later files
+    const std::string* match(const std::string& file, uint64_t size) {
+        if (size == 0) return nullptr;
+        uint64_t sample;
+        if (!keyed(file, size, sample)) return nullptr;
+        std::vector<size_t>& group = by_sample[sample];
+        for (size_t index : group) {
+            const Candidate& other = candidates[index];
+            if (other.size == size && same_contents(other.path, file, size)) {
+                return &other.path;
+            }
+        }
+        group.push_back(candidates.size());
+        candidates.push_back({file, size});
+        return nullptr;
+    }
+
+private:
+    // Bytes read at each of the three sample points
+    static const size_t SAMPLE_BYTES = 64 * 1024;
+
+    struct Candidate {
+        std::string path;
+        uint64_t size;
+    };
+
+    // Whether file is to be keyed by its sample: false for the first file
+    // of its size, which is held back until a second one turns up, and for
+    // a file that cannot be read
+    bool keyed(const std::string& file, uint64_t size, uint64_t& sample) {
+        auto first = first_of_size.emplace(size, file);
+        if (first.second) return false;
+        if (!first.first->second.empty()) {
+            uint64_t first_sample;
+            if (read_sample(first.first->second, size, first_sample)) {
+                by_sample[first_sample].push_back(candidates.size());
+                candidates.push_back({std::move(first.first->second), size});
+            }
+            first.first->second.clear();
+        }
+        return read_sample(file, size, sample);
+    }
+
+    static bool read_sample(const std::string& path, uint64_t size, uint64_t& hash) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+        std::vector<unsigned char> buffer(SAMPLE_BYTES);
+        std::vector<std::pair<uint64_t, uint64_t>> ranges; // offset, length
+        if (size <= 3 * SAMPLE_BYTES) {
+            ranges.push_back({0, size});
+        } else {
+            ranges.push_back({0, SAMPLE_BYTES});
+            ranges.push_back({size / 2 - SAMPLE_BYTES / 2, SAMPLE_BYTES});
+            ranges.push_back({size - SAMPLE_BYTES, SAMPLE_BYTES});
+        }
+        hash = size;
+        bool ok = true;
+        for (const auto& range : ranges) {
+            for (uint64_t done = 0; ok && done < range.second;) {
+                size_t want = static_cast<size_t>(std::min<uint64_t>(buffer.size(), range.second - done));
+                ssize_t n = pread(fd, buffer.data(), want, static_cast<off_t>(range.first + done));
+                if (n < 0 && errno == EINTR) continue;
+                ok = n > 0;
+                if (!ok) break;
+                hash = content_hash(buffer.data(), static_cast<size_t>(n), hash);
+                done += n;
+            }
+        }
+        close(fd);
+        return ok;
+    }
+
+    // Whether the first size bytes of two files are equal, reading both
+    // until the first difference
+    static bool same_contents(const std::string& a, const std::string& b, uint64_t size) {
+        int fd_a = open(a.c_str(), O_RDONLY | O_CLOEXEC);
+        int fd_b = fd_a < 0 ? -1 : open(b.c_str(), O_RDONLY | O_CLOEXEC);
+        bool same = fd_b >= 0;
+        std::vector<unsigned char> buffer_a(same ? 1 << 20 : 0), buffer_b(buffer_a.size());
+        auto read_full = [](int fd, unsigned char* data, size_t want, uint64_t offset) {
+            for (size_t done = 0; done < want;) {
+                ssize_t n = pread(fd, data + done, want - done, static_cast<off_t>(offset + done));
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) return false;
+                done += n;
+            }
+            return true;
+        };
+        for (uint64_t offset = 0; same && offset < size;) {
+            size_t want = static_cast<size_t>(std::min<uint64_t>(buffer_a.size(), size - offset));
+            same = read_full(fd_a, buffer_a.data(), want, offset) && read_full(fd_b, buffer_b.data(), want, offset) &&
+                   std::memcmp(buffer_a.data(), buffer_b.data(), want) == 0;
+            offset += want;
+        }
+        if (fd_a >= 0) close(fd_a);
+        if (fd_b >= 0) close(fd_b);
+        return same;
+    }
+
+    std::unordered_map<uint64_t, std::string> first_of_size; // emptied once that size is keyed
+    std::unordered_map<uint64_t, std::vector<size_t>> by_sample;
+    std::vector<Candidate> candidates;
+};
+
+// Failure list kept next to the database (<database>.failed), one line per
+// file: path|reason|size mtime_ns dev ino. A listed file is skipped on later
+// runs until its metadata changes.
+std::string failure_list_path(const std::string& database) {
+    return database + ".failed";
+}
+
+std::map<std::string, std::pair<FileMeta, std::string>> load_failure_list(const std::string& filename) {
+    std::map<std::string, std::pair<FileMeta, std::string>> failed;
+    std::ifstream file(filename);
+    std::string line;
+    while (std::getline(file, line)) {
+        size_t pos1 = line.find('|');
+        if (pos1 == std::string::npos) continue;
+        size_t pos2 = line.find('|', pos1 + 1);
+        if (pos2 == std::string::npos) continue;
+        FileMeta meta;
+        std::istringstream meta_stream(line.substr(pos2 + 1));
+        if (meta_stream >> meta.size >> meta.mtime_ns >> meta.dev >> meta.ino) {
+            failed[line.substr(0, pos1)] = {meta, line.substr(pos1 + 1, pos2 - pos1 - 1)};
+        }
+    }
+    return failed;
+}
+
+void save_failure_list(const std::string& filename, const std::vector<FailedFile>& failures,
+                       const std::map<std::string, FileMeta>& input_meta) {
+    std::ofstream file(filename, std::ios::app);
+    for (const auto& failure : failures) {
+        auto it = input_meta.find(failure.filename);
+        if (it == input_meta.end() || !it->second.known()) continue;
+        const FileMeta& meta = it->second;
+        file << failure.filename << "|" << failure.reason << "|" << meta.size << " " << meta.mtime_ns << " "
+             << meta.dev << " " << meta.ino << "\n";
+    }
+}
+
+// A --relocate rule: paths under from are rewritten to be under to
+struct PathRelocation {
+    std::string from;
+    std::string to;
+};
+
+// Apply the first rule whose prefix path starts with, matching whole path
+// components only; returns false if no rule applies
+bool relocate_path(std::string_view path, const std::vector<PathRelocation>& relocations, std::string& relocated) {
+    for (const auto& rule : relocations) {
+        const std::string& from = rule.from;
+        if (path.compare(0, from.size(), from) != 0) continue;
+        if (path.size() > from.size() && from.back() != '/' && path[from.size()] != '/') continue;
+        relocated = rule.to;
+        relocated += path.substr(from.size());
+        return true;
+    }
+    return false;
+}
+
+// Metadata for an entry moved to path: the recorded size and mtime must
+// still match the file there, whose device and inode are then taken over so
+// the entry is trusted at its new location. Otherwise the old metadata is
+// kept and the file is hashed again when it is next seen.
+FileMeta relocated_meta(const std::string& path, const FileMeta& meta, size_t& refreshed) {
+    if (!meta.known()) return meta;
+    FileMeta moved = stat_file_meta(path);
+    if (!moved.known() || moved.size != meta.size || moved.mtime_ns != meta.mtime_ns) return meta;
+    ++refreshed;
+    return moved;
+}
+
+// Rewrite a database with one entry per path, sorted by path, optionally
+// moving paths to new prefixes, and do the same for its failure list. The
+// files are replaced atomically in their own format. When a moved path
+// lands on a path the database already has, the entry that was not moved
+// is kept, since it was hashed at that location.
+bool compact_database(const std::string& filename, const std::vector<PathRelocation>& relocations) {
+    HashStore loaded = load_hashes(filename);
+    std::vector<HashStore::Id> ids = loaded.current_entries();
+    size_t superseded = loaded.size() - ids.size();
+
+    HashStore relocated_store;
+    size_t relocated = 0, refreshed = 0;
+    if (!relocations.empty()) {
+        relocated_store.reserve(ids.size(), loaded.block_count());
+        std::vector<HashStore::Id> kept;
+        std::string path;
+        for (HashStore::Id id : ids) {
+            if (!relocate_path(loaded.path(id), relocations, path)) {
+                kept.push_back(id);
+                continue;
+            }
+            relocated_store.add(path, loaded.hash(id), loaded.length(id), relocated_meta(path, loaded.meta(id), refreshed));
+            ++relocated;
+        }
+        for (HashStore::Id id : kept) {
+            relocated_store.add(loaded.path(id), loaded.hash(id), loaded.length(id), loaded.meta(id));
+        }
+    }
+    const HashStore& store = relocations.empty() ? loaded : relocated_store;
+    std::vector<HashStore::Id> compacted = relocations.empty() ? ids : store.current_entries();
+
+    DbFormat format = is_binary_database(filename) ? DbFormat::Binary : DbFormat::Text;
+    if (!write_database(filename, store, compacted, format)) {
+        return false;
+    }
+    if (format == DbFormat::Binary) {
+        std::remove(journal_path(filename).c_str());
+    }
+    std::cerr << "Compacted " << filename << ": " << compacted.size() << " entries kept, " << superseded
+              << " superseded records dropped";
+    if (!relocations.empty()) {
+        std::cerr << ", " << relocated << " paths relocated (" << refreshed << " matched at their new location, "
+                  << ids.size() - compacted.size() << " merged into existing entries)";
+    }
+    std::cerr << std::endl;
+
+    std::string failed_name = failure_list_path(filename);
+    if (!std::filesystem::exists(failed_name)) return true;
+    auto failed = load_failure_list(failed_name);
+    std::map<std::string, std::pair<FileMeta, std::string>> moved_failures;
+    std::string path;
+    size_t failed_refreshed = 0;
+    for (auto it = failed.begin(); it != failed.end();) {
+        if (relocate_path(it->first, relocations, path)) {
+            moved_failures[path] = {relocated_meta(path, it->second.first, failed_refreshed), it->second.second};
+            it = failed.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    // As for hashes, a failure recorded at the new location wins
+    failed.merge(moved_failures);
+
+    std::string tmp_name = failed_name + ".tmp";
+    std::ofstream file(tmp_name, std::ios::trunc);
+    for (const auto& [name, failure] : failed) {
+        const FileMeta& meta = failure.first;
+        file << name << "|" << failure.second << "|" << meta.size << " " << meta.mtime_ns << " " << meta.dev << " "
+             << meta.ino << "\n";
+    }
+    file.close();
+    if (!file || std::rename(tmp_name.c_str(), failed_name.c_str()) != 0) {
+        std::cerr << "Error: Could not write failure list " << failed_name << ": " << std::strerror(errno) << std::endl;
+        std::remove(tmp_name.c_str());
+        return false;
+    }
+    std::cerr << "Compacted " << failed_name << ": " << failed.size() << " failed files kept" << std::endl;
+    return true;
+}
+
+// Write a whole buffer to a socket; a peer that went away is not a signal
+bool send_all(int fd, const std::string& data) {
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = send(fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += n;
+    }
+    return true;
+}
+
+// Buffered line reader over a socket
+class SocketLineReader {
+private:
+    int fd;
+    std::string buffer;
+
+public:
+    explicit SocketLineReader(int f) : fd(f) {}
+
+    bool read_line(std::string& line) {
+        size_t nl;
+        while ((nl = buffer.find('\n')) == std::string::npos) {
+            char chunk[4096];
+            ssize_t n = read(fd, chunk, sizeof(chunk));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            buffer.append(chunk, n);
+        }
+        line = buffer.substr(0, nl);
+        buffer.erase(0, nl + 1);
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        return true;
+    }
+};
+
+// Fill in a Unix socket address; false when the path does not fit
+bool unix_address(const std::string& path, struct sockaddr_un& addr) {
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) return false;
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+int connect_unix(const std::string& path) {
+    struct sockaddr_un addr;
+    if (!unix_address(path, addr)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+// Resident server mode (--serve). Keeps the database in memory, with a
+// multi-index hash over it for images, and answers line-based requests on
+// a Unix domain socket, one request per line:
+//
+//   HASH <path>                 hash a file (stored hash while it is unchanged)
+//   INSERT <path>               hash a file and add it to the database
+//   QUERY <threshold|-> <path>  hash a file and list database entries near it
+//   STATS                       number of entries
+//
+// Every answer ends with an "OK ..." or "ERR <message>" line. HASH and
+// INSERT answer "OK <length> <hex blocks>"; QUERY sends one
+// "MATCH <dist> <offset> <path>" line per match, then "OK <count>".
+// Queries share the database; an insert locks it only to publish the entry.
+class HashServer {
+private:
+    std::string database;
+    DbFormat new_format;
+    bool image_mode;
+    CompareOptions options;
+    HashWorkerOptions worker_options;
+
+    // Replaced entries stay in the store but are skipped by queries
+    HashStore store;
+    std::vector<ulong64> codes; // image mode: entries' hashes, indexed by id
+    std::unique_ptr<MultiIndexHash> index;
+    size_t indexed = 0;         // entries covered by the index; the rest are scanned
+    mutable std::shared_mutex mutex;
+    std::mutex persist_mutex;
+
+    void index_entries() {
+        if (!image_mode) return;
+        for (HashStore::Id id = codes.size(); id < store.size(); ++id) {
+            codes.push_back(store.hash(id)[0]);
+        }
+    }
+
+    // Entries added since the last build are scanned linearly; rebuild once
+    // that tail is a sizeable fraction of the database
+    void maybe_reindex() {
+        if (!image_mode) return;
+        size_t tail = codes.size() - indexed;
+        if (index && tail < std::max<size_t>(4096, indexed / 8)) return;
+        index.reset(new MultiIndexHash(codes));
+        indexed = codes.size();
+    }
+
+    // Hash of a file: the stored one while the file is unchanged, otherwise
+    // computed (without holding the database lock)
+    bool file_hash(const std::string& path, std::vector<ulong64>& blocks, FileMeta& meta, bool& stored, std::string& error) {
+        meta = stat_file_meta(path);
+        stored = false;
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            HashStore::Id id = store.find(path);
+            if (id != HashStore::NONE && (!store.meta(id).known() || store.meta(id) == meta)) {
+                blocks.assign(store.hash(id), store.hash(id) + store.length(id));
+                stored = true;
+                return true;
+            }
+        }
         int length = 0;
-        ulong64* hash = ph_dct_videohash(filename.c_str(), length);
-        if (!hash || length == 0) {
-            std::lock_guard<std::mutex> lock(cerr_mutex);
-            std::cerr << "Failed to compute video hash for " << filename << std::endl;
-            continue;
+        bool timed_out = false;
+        ulong64* hash = compute_file_hash(path, image_mode, worker_options, length, timed_out);
+        if (!hash) {
+            error = timed_out ? "timeout" : "could not hash file";
+            return false;
+        }
+        blocks.assign(hash, hash + length);
+        free(hash);
+        return true;
+    }
+
+    bool insert(const std::string& path, const std::vector<ulong64>& blocks, const FileMeta& meta, std::string& error) {
+        int length = static_cast<int>(blocks.size());
+
+        // Durable before it is visible, so an acknowledged insert survives a crash
+        std::lock_guard<std::mutex> persist_lock(persist_mutex);
+        if (!checkpoint_hashes(database, format_text_record(path, blocks.data(), length, meta), new_format)) {
+            error = "could not write database";
+            return false;
+        }
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        store.add(path, blocks.data(), length, meta);
+        index_entries();
+        maybe_reindex();
+        return true;
+    }
+
+    std::string query(const std::string& path, const std::vector<ulong64>& blocks, int threshold) const {
+        CompareOptions query_options = options;
+        query_options.threshold = threshold;
+        std::vector<RowMatch> row;
+        int length = static_cast<int>(blocks.size());
+
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        auto scan = [&](HashStore::Id begin) {
+            for (HashStore::Id id = begin; id < store.size(); ++id) {
+                if (!store.is_current(id) || store.path(id) == path) continue;
+                int offset;
+                int dist = pair_distance(blocks.data(), length, store.hash(id), store.length(id), query_options, offset);
+                if (dist >= 0) {
+                    row.push_back({id, dist, offset});
+                    trim_row(row, options.top_k);
+                }
+            }
+        };
+        bool use_index = image_mode && index && threshold >= 0 && length == 1 &&
+                         MultiIndexHash::probes_per_query(indexed, threshold) * 4 < indexed;
+        if (use_index) {
+            index->query(blocks[0], threshold, [&](uint32_t id, int dist) {
+                if (!store.is_current(id) || store.path(id) == path) return;
+                row.push_back({id, dist, -1});
+                trim_row(row, options.top_k);
+            });
+            scan(static_cast<HashStore::Id>(indexed));
+        } else {
+            scan(0);
+        }
+        finish_row(row, options.top_k);
+
+        std::string response;
+        for (const auto& match : row) {
+            response += "MATCH " + std::to_string(match.dist) + " " + std::to_string(match.offset) + " ";
+            response += store.path(match.other);
+            response += "\n";
+        }
+        return response + "OK " + std::to_string(row.size()) + "\n";
+    }
+
+public:
+    HashServer(HashStore&& db, const std::string& database, DbFormat new_format, bool image_mode,
+               const CompareOptions& options, const HashWorkerOptions& worker_options)
+        : database(database), new_format(new_format), image_mode(image_mode), options(options),
+          worker_options(worker_options), store(std::move(db)) {
+        index_entries();
+        maybe_reindex();
+    }
+
+    size_t size() const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return store.path_count();
+    }
+
+    // Answer one request line
+    std::string handle(const std::string& request) {
+        size_t space = request.find(' ');
+        std::string verb = request.substr(0, space);
+        std::string arg = space == std::string::npos ? std::string() : request.substr(space + 1);
+
+        if (verb == "STATS") {
+            return "OK " + std::to_string(size()) + "\n";
+        }
+
+        int threshold = options.threshold;
+        if (verb == "QUERY") {
+            size_t split = arg.find(' ');
+            if (split == std::string::npos) {
+                return "ERR usage: QUERY <threshold|-> <path>\n";
+            }
+            std::string value = arg.substr(0, split);
+            if (value != "-") {
+                threshold = std::atoi(value.c_str());
+                if (threshold < 0) {
+                    return "ERR threshold must be a positive integer\n";
+                }
+            }
+            arg = arg.substr(split + 1);
+        } else if (verb != "HASH" && verb != "INSERT") {
+            return "ERR unknown request: " + verb + "\n";
+        }
+        if (arg.empty()) {
+            return "ERR missing path\n";
+        }
+
+        std::vector<ulong64> blocks;
+        FileMeta meta;
+        bool stored;
+        std::string error;
+        if (!file_hash(arg, blocks, meta, stored, error)) {
+            return "ERR " + error + "\n";
+        }
+        if (verb == "QUERY") {
+            return query(arg, blocks, threshold);
+        }
+        if (verb == "INSERT" && !stored && !insert(arg, blocks, meta, error)) {
+            return "ERR " + error + "\n";
+        }
+        return "OK " + std::to_string(blocks.size()) + " " +
+               hash_to_hex(blocks.data(), static_cast<int>(blocks.size())) + "\n";
+    }
+};
+
+// Listening socket of a running server, for the signal handler
+static volatile sig_atomic_t server_stopping = 0;
+static int server_listen_fd = -1;
+
+static void stop_server(int) {
+    server_stopping = 1;
+    shutdown(server_listen_fd, SHUT_RDWR);
+}
+
+void serve_connection(HashServer& server, int fd) {
+    SocketLineReader reader(fd);
+    std::string line;
+    while (reader.read_line(line)) {
+        if (!send_all(fd, server.handle(line))) break;
+    }
+}
+
+// Accept connections on socket_path until SIGINT or SIGTERM; each
+// connection is served by one of num_jobs handler threads
+int run_server(HashServer& server, const std::string& socket_path, int num_jobs) {
+    struct sockaddr_un addr;
+    if (!unix_address(socket_path, addr)) {
+        std::cerr << "Error: Socket path is too long: " << socket_path << std::endl;
+        return 1;
+    }
+
+    // A socket left behind by a server that died is replaced; a live one is not
+    struct stat st;
+    if (lstat(socket_path.c_str(), &st) == 0) {
+        int probe = connect_unix(socket_path);
+        if (probe >= 0) {
+            close(probe);
+            std::cerr << "Error: A server is already listening on " << socket_path << std::endl;
+            return 1;
+        }
+        if (!S_ISSOCK(st.st_mode)) {
+            std::cerr << "Error: " << socket_path << " exists and is not a socket" << std::endl;
+            return 1;
+        }
+        unlink(socket_path.c_str());
+    }
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0 || bind(listen_fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0 ||
+        listen(listen_fd, SOMAXCONN) != 0) {
+        std::cerr << "Error: Could not listen on " << socket_path << ": " << std::strerror(errno) << std::endl;
+        if (listen_fd >= 0) close(listen_fd);
+        return 1;
+    }
+
+    server_listen_fd = listen_fd;
+    struct sigaction action = {};
+    action.sa_handler = stop_server;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    // Open client connections, queued or being served, so they can be shut
+    // down when the server stops; an fd is closed only after it is removed
+    ThreadSafeQueue<int> connections;
+    std::mutex clients_mutex;
+    std::set<int> clients;
+    std::vector<std::thread> handlers;
+    for (int i = 0; i < num_jobs; ++i) {
+        handlers.emplace_back([&]() {
+            int fd;
+            while (connections.wait_and_pop(fd)) {
+                serve_connection(server, fd);
+                {
+                    std::lock_guard<std::mutex> lock(clients_mutex);
+                    clients.erase(fd);
+                }
+                close(fd);
+            }
+        });
+    }
+    std::cerr << "Serving " << server.size() << " hashes on " << socket_path << " with " << num_jobs
+              << " threads" << std::endl;
+
+    while (!server_stopping) {
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (!server_stopping) {
+                std::cerr << "Error: accept failed: " << std::strerror(errno) << std::endl;
+            }
+            break;
+        }
+        {
+            std::lock_guard<std::mutex> lock(clients_mutex);
+            clients.insert(fd);
+        }
+        connections.push(fd);
+    }
+
+    close(listen_fd);
+    unlink(socket_path.c_str());
+    connections.close();
+    // Inserts are on disk as soon as they are acknowledged; idle clients are
+    // disconnected so their handlers return, and a request being answered
+    // finishes first
+    {
+        std::lock_guard<std::mutex> lock(clients_mutex);
+        for (int fd : clients) {
+            shutdown(fd, SHUT_RDWR);
+        }
+    }
+    for (auto& handler : handlers) {
+        handler.join();
+    }
+    std::cerr << "Server stopped" << std::endl;
+    return 0;
+}
+
+// Client side of --serve: send one request per file and print the answers,
+// query matches in the usual output format
+int run_client(const std::string& socket_path, const std::string& request, int threshold,
+               const std::vector<std::string>& files, ResultWriter& writer) {
+    int fd = connect_unix(socket_path);
+    if (fd < 0) {
+        std::cerr << "Error: Could not connect to " << socket_path << ": " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+    SocketLineReader reader(fd);
+    std::string verb = request == "hash" ? "HASH" : request == "insert" ? "INSERT" : "QUERY";
+    int status = 0;
+    for (const auto& file : files) {
+        // The server resolves paths against its own working directory
+        std::string path = std::filesystem::absolute(file).lexically_normal().string();
+        std::string line = verb + " ";
+        if (verb == "QUERY") {
+            line += (threshold < 0 ? std::string("-") : std::to_string(threshold)) + " ";
+        }
+        if (!send_all(fd, line + path + "\n")) {
+            std::cerr << "Error: Lost connection to " << socket_path << std::endl;
+            close(fd);
+            return 1;
+        }
+        std::string answer;
+        for (;;) {
+            if (!reader.read_line(answer)) {
+                std::cerr << "Error: Lost connection to " << socket_path << std::endl;
+                close(fd);
+                return 1;
+            }
+            if (answer.compare(0, 6, "MATCH ") == 0) {
+                std::istringstream fields(answer.substr(6));
+                int dist, offset;
+                fields >> dist >> offset;
+                fields.get();
+                std::string match;
+                std::getline(fields, match);
+                writer.pair(dist, path, match, offset);
+                continue;
+            }
+            break;
+        }
+        if (answer.compare(0, 4, "ERR ") == 0) {
+            std::cerr << "Error: " << path << ": " << answer.substr(4) << std::endl;
+            status = 1;
+        } else if (verb != "QUERY") {
+            // OK <length> <hex blocks>, printed as a text database record
+            std::istringstream fields(answer.substr(3));
+            std::string length;
+            fields >> length;
+            fields.get();
+            std::string hex;
+            std::getline(fields, hex);
+            writer.flush();
+            std::cout << path << "|" << length << "|" << hex << std::endl;
+        }
+    }
+    writer.flush();
+    close(fd);
+    return status;
+}
+
+// Fingerprint of the entries a sharded comparison runs over, so partial
+// files of another database (or another version of it) are not merged
+uint64_t hash_set_fingerprint(const HashStore& store, const std::vector<HashStore::Id>& ids) {
+    uint64_t fingerprint = ids.size();
+    for (HashStore::Id id : ids) {
+        std::string_view path = store.path(id);
+        fingerprint = content_hash(reinterpret_cast<const unsigned char*>(path.data()), path.size(), fingerprint);
+        fingerprint = content_hash(reinterpret_cast<const unsigned char*>(store.hash(id)),
+                                   store.length(id) * sizeof(ulong64), fingerprint);
+    }
+    return fingerprint;
+}
+
+// Combine the partial files of --shard runs over store's current entries
+// into the output of one unsharded comparison. The files may come in any
+// order but must be the complete set of shards. Each shard's matches are
+// already sorted within their rows and the shards cover consecutive rows,
+// so pairs are streamed straight through; with options.cluster they are
+// merged into groups first. The comparison options come from the files.
+int merge_shards(const HashStore& store, const std::vector<std::string>& files, CompareOptions options,
+                 ResultWriter& writer) {
+    std::vector<HashStore::Id> ids = store.current_entries();
+    uint64_t fingerprint = hash_set_fingerprint(store, ids);
+
+    std::vector<std::pair<ShardHeader, std::string>> shards;
+    for (const auto& file : files) {
+        std::ifstream in(file);
+        std::string line;
+        ShardHeader header;
+        if (!in || !std::getline(in, line) || !parse_shard_header(line, header)) {
+            std::cerr << "Error: " << file << " is not a phash-compare shard file" << std::endl;
+            return 1;
+        }
+        if (header.entries != ids.size() || header.fingerprint != fingerprint) {
+            std::cerr << "Error: " << file << " was written for a different database" << std::endl;
+            return 1;
+        }
+        const ShardHeader& first = shards.empty() ? header : shards.front().first;
+        if (header.shards != first.shards || header.threshold != first.threshold || header.top_k != first.top_k ||
+            header.subclip != first.subclip) {
+            std::cerr << "Error: " << file << " was written with other --shard, -d, --top-k or --subclip options" << std::endl;
+            return 1;
+        }
+        shards.emplace_back(header, file);
+    }
+    std::sort(shards.begin(), shards.end(), [](const auto& a, const auto& b) { return a.first.shard < b.first.shard; });
+    size_t count = shards.front().first.shards;
+    for (size_t s = 1; s < shards.size(); ++s) {
+        if (shards[s].first.shard == shards[s - 1].first.shard) {
+            std::cerr << "Error: Shard " << shards[s].first.shard << "/" << count << " given twice" << std::endl;
+            return 1;
+        }
+    }
+    size_t expected_row = 0;
+    for (size_t s = 0; s < count; ++s) {
+        if (s >= shards.size() || shards[s].first.shard != s + 1) {
+            std::cerr << "Error: Shard " << (s + 1) << "/" << count << " is missing" << std::endl;
+            return 1;
+        }
+        if (shards[s].first.row_begin != expected_row) {
+            std::cerr << "Error: " << shards[s].second << " does not start where the previous shard ends" << std::endl;
+            return 1;
+        }
+        expected_row = shards[s].first.row_end;
+    }
+
+    const ShardHeader& header = shards.front().first;
+    options.threshold = header.threshold;
+    options.top_k = header.top_k;
+    options.subclip = header.subclip;
+    if (options.cluster && options.threshold < 0) {
+        std::cerr << "Error: --cluster requires the shards to be compared with a threshold (-d)" << std::endl;
+        return 1;
+    }
+    if (options.cluster && options.top_k > 0) {
+        std::cerr << "Error: --cluster requires the shards to be compared without --top-k" << std::endl;
+        return 1;
+    }
+
+    ConcurrentUnionFind clusters(options.cluster ? ids.size() : 0);
+    uint64_t matches = 0;
+    for (const auto& [shard, file] : shards) {
+        std::ifstream in(file);
+        std::string line;
+        std::getline(in, line);
+        while (std::getline(in, line)) {
+            // row other distance offset
+            size_t fields[2];
+            int values[2];
+            const char* p = line.data();
+            const char* end = line.data() + line.size();
+            bool ok = true;
+            for (int f = 0; f < 4 && ok; ++f) {
+                while (p < end && *p == ' ') ++p;
+                auto result = f < 2 ? std::from_chars(p, end, fields[f]) : std::from_chars(p, end, values[f - 2]);
+                ok = result.ec == std::errc();
+                p = result.ptr;
+            }
+            if (!ok || p != end || fields[0] < shard.row_begin || fields[0] >= shard.row_end ||
+                fields[1] <= fields[0] || fields[1] >= ids.size()) {
+                std::cerr << "Error: " << file << ": malformed match line: " << line << std::endl;
+                return 1;
+            }
+            if (options.cluster) {
+                clusters.unite(static_cast<uint32_t>(fields[0]), static_cast<uint32_t>(fields[1]));
+            } else {
+                writer.pair(values[0], store.path(ids[fields[0]]), store.path(ids[fields[1]]), values[1]);
+            }
+            ++matches;
+        }
+        if (in.bad()) {
+            std::cerr << "Error: Could not read " << file << std::endl;
+            return 1;
+        }
+    }
+    std::cerr << "Merged " << shards.size() << " shards: " << matches << " matched" << std::endl;
+    if (options.cluster) {
+        FlatHashes flat(store, ids);
+        size_t count = write_clusters(flat, clusters, options, writer);
+        std::cerr << "Clusters: " << count << " groups of duplicates" << std::endl;
+    }
+    writer.flush();
+    return 0;
+}
+
+// Everything --stats and --stats-json report about a run
+struct RunStats {
+    StageTime scan, load, hash, compare, output, save;
+    uint64_t entries_loaded = 0;
+    uint64_t files_found = 0;
+    uint64_t files_hashed = 0;
+    uint64_t files_failed = 0;
+    uint64_t files_identical = 0; // reused the hash of a byte-identical file
+    uint64_t bytes_hashed = 0;
+    uint64_t hash_workers = 0; // -j, or the level -j auto settled on
+    LatencyHistogram hash_latency;
+    CompareStats pairs;
+    uint64_t output_bytes = 0;
+    double started = wall_seconds();
+};
+
+// Peak resident set size of this process in KiB
+long peak_rss_kib() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static double per_second(double amount, double seconds) {
+    return seconds > 0 ? amount / seconds : 0;
+}
+
+std::string format_stats_json(const RunStats& stats) {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(6);
+    out << "{\"wall\":" << wall_seconds() - stats.started << ",\"stages\":{";
+    const std::pair<const char*, const StageTime*> stages[] = {
+        {"scan", &stats.scan}, {"load", &stats.load}, {"hash", &stats.hash},
+        {"compare", &stats.compare}, {"output", &stats.output}, {"save", &stats.save},
+    };
+    for (size_t s = 0; s < sizeof(stages) / sizeof(stages[0]); ++s) {
+        out << (s ? "," : "") << "\"" << stages[s].first << "\":{\"wall\":" << stages[s].second->wall
+            << ",\"cpu\":" << stages[s].second->cpu << "}";
+    }
+    out << "},\"database_entries\":" << stats.entries_loaded;
+    out << ",\"files\":{\"found\":" << stats.files_found << ",\"hashed\":" << stats.files_hashed
+        << ",\"failed\":" << stats.files_failed << ",\"identical\":" << stats.files_identical
+        << ",\"bytes_hashed\":" << stats.bytes_hashed
+        << ",\"files_per_second\":" << per_second(stats.files_hashed, stats.hash.wall)
+        << ",\"bytes_per_second\":" << per_second(stats.bytes_hashed, stats.hash.wall)
+        << ",\"hash_workers\":" << stats.hash_workers << "}";
+    const LatencyHistogram& latency = stats.hash_latency;
+    out << ",\"hash_latency\":{\"count\":" << latency.count
+        << ",\"mean\":" << (latency.count ? latency.total / latency.count : 0) << ",\"max\":" << latency.max
+        << ",\"buckets\":[";
+    for (int b = 0; b < LatencyHistogram::BUCKETS; ++b) {
+        out << (b ? "," : "") << "{\"lt_ms\":";
+        if (b < LatencyHistogram::BUCKETS - 1) {
+            out << (1ULL << b);
+        } else {
+            out << "null";
         }
-        
-        results.push_back(VideoHash(filename, hash, length));
-        
-        std::lock_guard<std::mutex> lock(cerr_mutex);
-        std::cerr << "Computed video hash for " << filename << std::endl;
+        out << ",\"count\":" << latency.counts[b] << "}";
     }
+    out << "]}";
+    out << ",\"pairs\":{\"total\":" << stats.pairs.pairs << ",\"length_pruned\":" << stats.pairs.length_pruned
+        << ",\"rejected\":" << stats.pairs.rejected << ",\"matched\":" << stats.pairs.matched
+        << ",\"per_second\":" << per_second(stats.pairs.pairs, stats.compare.wall) << "}";
+    out << ",\"output_bytes\":" << stats.output_bytes << ",\"peak_rss_kib\":" << peak_rss_kib() << "}\n";
+    return out.str();
 }
 
-// Worker thread function for image hashing
-void image_hash_worker(ThreadSafeQueue<std::string>& work_queue, 
-                       ThreadSafeVector<VideoHash>& results,
-                       std::mutex& cerr_mutex) {
-    std::string filename;
-    while (work_queue.pop(filename)) {
-        ulong64 hash;
-        int result = ph_dct_imagehash(filename.c_str(), hash);
-        if (result != 0 || hash == 0) {
-            std::lock_guard<std::mutex> lock(cerr_mutex);
-            std::cerr << "Failed to compute image hash for " << filename << std::endl;
-            continue;
+// Human-readable summary on stderr
+void print_stats(const RunStats& stats) {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(3);
+    out << "Stats (" << wall_seconds() - stats.started << "s wall):\n";
+    out << "  stage        wall s     cpu s\n";
+    const std::pair<const char*, const StageTime*> stages[] = {
+        {"scan", &stats.scan}, {"load", &stats.load}, {"hash", &stats.hash},
+        {"compare", &stats.compare}, {"output", &stats.output}, {"save", &stats.save},
+    };
+    for (const auto& stage : stages) {
+        out << "  " << std::left << std::setw(8) << stage.first << std::right << std::setw(11) << stage.second->wall
+            << std::setw(10) << stage.second->cpu << "\n";
+    }
+    out << "  files: " << stats.files_found << " found, " << stats.files_hashed << " hashed, " << stats.files_failed
+        << " failed, " << stats.files_identical << " identical; " << std::setprecision(1) << per_second(stats.files_hashed, stats.hash.wall) << " files/s, "
+        << per_second(stats.bytes_hashed, stats.hash.wall) / (1 << 20) << " MiB/s with " << stats.hash_workers
+        << " workers\n";
+    const LatencyHistogram& latency = stats.hash_latency;
+    if (latency.count > 0) {
+        out << std::setprecision(3) << "  hash latency: mean " << latency.total / latency.count << "s, max "
+            << latency.max << "s;";
+        for (int b = 0; b < LatencyHistogram::BUCKETS; ++b) {
+            if (latency.counts[b] == 0) continue;
+            if (b < LatencyHistogram::BUCKETS - 1) {
+                out << " <" << (1ULL << b) << "ms:" << latency.counts[b];
+            } else {
+                out << " more:" << latency.counts[b];
+            }
         }
-        
-        // For images, we create a single-element hash array
-        ulong64* hash_array = (ulong64*)malloc(sizeof(ulong64));
-        hash_array[0] = hash;
-        
-        results.push_back(VideoHash(filename, hash_array, 1));
-        
-        std::lock_guard<std::mutex> lock(cerr_mutex);
-        std::cerr << "Computed image hash for " << filename << std::endl;
+        out << "\n";
     }
+    out << std::setprecision(0) << "  pairs: " << stats.pairs.pairs << " compared, " << stats.pairs.matched
+        << " matched; " << per_second(stats.pairs.pairs, stats.compare.wall) << " pairs/s\n";
+    out << "  output: " << stats.output_bytes << " bytes; peak RSS " << peak_rss_kib() / 1024 << " MiB\n";
+    std::cerr << out.str();
 }
 
+// The benchmark includes this file for its internals and brings its own main
+#ifndef PHASH_COMPARE_NO_MAIN
 int main(int argc, char* argv[]) {
     int threshold = -1; // -1 means print all
     std::string source_file;
     bool write_hashes = false;
     bool generate_only = false;
     int num_jobs = 1; // Default to single-threaded
+    bool auto_jobs = false;
     bool image_mode = false;
     bool video_mode = false;
     std::vector<std::string> recursive_dirs;
     std::set<std::string> file_types;
+    SearchMode search_mode = SearchMode::Auto;
+    std::string convert_target;
+    DbFormat db_format = DbFormat::Text;
+    bool db_format_set = false;
+    bool prune = false;
+    size_t top_k = 0;
+    OutputFormat output_format = OutputFormat::Text;
+    bool subclip = false;
+    int file_timeout = 0;
+    bool retry_failed = false;
+    std::string hash_one;
+    size_t checkpoint_every = 1000;
+    int checkpoint_interval = 60;
+    std::string serve_socket;
+    std::string client_socket;
+    std::string client_request = "query";
+    bool new_only = false;
+    bool cluster = false;
+    bool quiet = false;
+    bool show_stats = false;
+    std::string stats_json;
+    bool scaled_images = false;
+    bool hash_copies = false;
+    VideoHashOptions video_options;
+    bool video_sample_set = false;
+    int decode_threads = 0;
+    size_t shard = 0;
+    size_t shards = 0;
+    bool merge = false;
+    bool compact = false;
+    std::vector<PathRelocation> relocations;
+    size_t readahead_files = 0;
+    uint64_t readahead_mib = 256;
     int opt;
 
+    // Long-only options get codes outside the char range
+    enum {
+        OPT_SEARCH = 256,
+        OPT_CONVERT,
+        OPT_DB_FORMAT,
+        OPT_PRUNE,
+        OPT_TOP_K,
+        OPT_OUTPUT,
+        OPT_SUBCLIP,
+        OPT_FILE_TIMEOUT,
+        OPT_RETRY_FAILED,
+        OPT_HASH_ONE,
+        OPT_CHECKPOINT_EVERY,
+        OPT_CHECKPOINT_INTERVAL,
+        OPT_SERVE,
+        OPT_CLIENT,
+        OPT_REQUEST,
+        OPT_NEW_ONLY,
+        OPT_CLUSTER,
+        OPT_STATS,
+        OPT_STATS_JSON,
+        OPT_HASH_COPIES,
+        OPT_IMAGE_HASH,
+        OPT_VIDEO_HASH,
+        OPT_VIDEO_SAMPLE,
+        OPT_DECODE_THREADS,
+        OPT_SHARD,
+        OPT_MERGE,
+        OPT_COMPACT,
+        OPT_RELOCATE,
+        OPT_READAHEAD,
+        OPT_READAHEAD_MB,
+    };
+    static const struct option long_options[] = {
+        {"search", required_argument, nullptr, OPT_SEARCH},
+        {"convert", required_argument, nullptr, OPT_CONVERT},
+        {"db-format", required_argument, nullptr, OPT_DB_FORMAT},
+        {"prune", no_argument, nullptr, OPT_PRUNE},
+        {"top-k", required_argument, nullptr, OPT_TOP_K},
+        {"output", required_argument, nullptr, OPT_OUTPUT},
+        {"subclip", no_argument, nullptr, OPT_SUBCLIP},
+        {"file-timeout", required_argument, nullptr, OPT_FILE_TIMEOUT},
+        {"retry-failed", no_argument, nullptr, OPT_RETRY_FAILED},
+        {"checkpoint-every", required_argument, nullptr, OPT_CHECKPOINT_EVERY},
+        {"checkpoint-interval", required_argument, nullptr, OPT_CHECKPOINT_INTERVAL},
+        {"serve", required_argument, nullptr, OPT_SERVE},
+        {"client", required_argument, nullptr, OPT_CLIENT},
+        {"request", required_argument, nullptr, OPT_REQUEST},
+        {"new-only", no_argument, nullptr, OPT_NEW_ONLY},
+        {"cluster", no_argument, nullptr, OPT_CLUSTER},
+        {"quiet", no_argument, nullptr, 'q'},
+        {"stats", no_argument, nullptr, OPT_STATS},
+        {"stats-json", required_argument, nullptr, OPT_STATS_JSON},
+        {"hash-copies", no_argument, nullptr, OPT_HASH_COPIES},
+        {"image-hash", required_argument, nullptr, OPT_IMAGE_HASH},
+        {"video-hash", required_argument, nullptr, OPT_VIDEO_HASH},
+        {"video-sample", required_argument, nullptr, OPT_VIDEO_SAMPLE},
+        {"decode-threads", required_argument, nullptr, OPT_DECODE_THREADS},
+        {"shard", required_argument, nullptr, OPT_SHARD},
+        {"merge", no_argument, nullptr, OPT_MERGE},
+        {"compact", no_argument, nullptr, OPT_COMPACT},
+        {"relocate", required_argument, nullptr, OPT_RELOCATE},
+        {"readahead", required_argument, nullptr, OPT_READAHEAD},
+        {"readahead-mb", required_argument, nullptr, OPT_READAHEAD_MB},
+        // Internal: hash one file to stdout, used by --file-timeout
+        {"hash-one", required_argument, nullptr, OPT_HASH_ONE},
+        {nullptr, 0, nullptr, 0}
+    };
+
     // Parse command line arguments using getopt
-    while ((opt = getopt(argc, argv, "d:s:wgj:ivr:t:")) != -1) {
+    while ((opt = getopt_long(argc, argv, "d:s:wgj:ivr:t:q", long_options, nullptr)) != -1) {
         switch (opt) {
             case 'd':
                 threshold = std::atoi(optarg);
@@ -299,9 +4743,10 @@ int main(int argc, char* argv[]) {
                 write_hashes = true; // -g implies -w
                 break;
             case 'j':
-                num_jobs = std::atoi(optarg);
+                auto_jobs = std::string(optarg) == "auto";
+                num_jobs = auto_jobs ? 1 : std::atoi(optarg);
                 if (num_jobs <= 0) {
-                    std::cerr << "Number of jobs must be positive" << std::endl;
+                    std::cerr << "Number of jobs must be positive or 'auto'" << std::endl;
                     return 1;
                 }
                 break;
@@ -321,27 +4766,362 @@ int main(int argc, char* argv[]) {
                     file_types.insert(ext);
                 }
                 break;
+            case OPT_SEARCH:
+                {
+                    std::string mode = optarg;
+                    if (mode == "auto") {
+                        search_mode = SearchMode::Auto;
+                    } else if (mode == "brute") {
+                        search_mode = SearchMode::Brute;
+                    } else if (mode == "index") {
+                        search_mode = SearchMode::Index;
+                    } else {
+                        std::cerr << "Search mode must be one of: auto, brute, index" << std::endl;
+                        return 1;
+                    }
+                }
+                break;
+            case OPT_TOP_K:
+                {
+                    int k = std::atoi(optarg);
+                    if (k <= 0) {
+                        std::cerr << "Top-K limit must be positive" << std::endl;
+                        return 1;
+                    }
+                    top_k = k;
+                }
+                break;
+            case OPT_OUTPUT:
+                {
+                    std::string format = optarg;
+                    if (format == "text") {
+                        output_format = OutputFormat::Text;
+                    } else if (format == "ndjson") {
+                        output_format = OutputFormat::Ndjson;
+                    } else {
+                        std::cerr << "Output format must be one of: text, ndjson" << std::endl;
+                        return 1;
+                    }
+                }
+                break;
+            case OPT_SUBCLIP:
+                subclip = true;
+                break;
+            case OPT_FILE_TIMEOUT:
+                file_timeout = std::atoi(optarg);
+                if (file_timeout <= 0) {
+                    std::cerr << "File timeout must be a positive number of seconds" << std::endl;
+                    return 1;
+                }
+                break;
+            case OPT_RETRY_FAILED:
+                retry_failed = true;
+                break;
+            case OPT_HASH_ONE:
+                hash_one = optarg;
+                break;
+            case OPT_CHECKPOINT_EVERY:
+                {
+                    int every = std::atoi(optarg);
+                    if (every < 0) {
+                        std::cerr << "Checkpoint count must be 0 (off) or a positive integer" << std::endl;
+                        return 1;
+                    }
+                    checkpoint_every = every;
+                }
+                break;
+            case OPT_CHECKPOINT_INTERVAL:
+                checkpoint_interval = std::atoi(optarg);
+                if (checkpoint_interval < 0) {
+                    std::cerr << "Checkpoint interval must be 0 (off) or a positive number of seconds" << std::endl;
+                    return 1;
+                }
+                break;
+            case OPT_SERVE:
+                serve_socket = optarg;
+                break;
+            case OPT_CLIENT:
+                client_socket = optarg;
+                break;
+            case OPT_REQUEST:
+                client_request = optarg;
+                if (client_request != "query" && client_request != "hash" && client_request != "insert") {
+                    std::cerr << "Request must be one of: query, hash, insert" << std::endl;
+                    return 1;
+                }
+                break;
+            case OPT_NEW_ONLY:
+                new_only = true;
+                break;
+            case OPT_CLUSTER:
+                cluster = true;
+                break;
+            case 'q':
+                quiet = true;
+                break;
+            case OPT_STATS:
+                show_stats = true;
+                break;
+            case OPT_STATS_JSON:
+                stats_json = optarg;
+                break;
+            case OPT_HASH_COPIES:
+                hash_copies = true;
+                break;
+            case OPT_IMAGE_HASH:
+                {
+                    std::string decode = optarg;
+                    if (decode == "phash") {
+                        scaled_images = false;
+                    } else if (decode == "scaled") {
+                        scaled_images = true;
+                    } else {
+                        std::cerr << "Image hash must be one of: phash, scaled" << std::endl;
+                        return 1;
+                    }
+                }
+                break;
+            case OPT_VIDEO_HASH:
+                {
+                    std::string backend = optarg;
+                    if (backend == "phash") {
+                        video_options.native = false;
+                    } else if (backend == "native") {
+                        video_options.native = true;
+                    } else {
+                        std::cerr << "Video hash must be one of: phash, native" << std::endl;
+                        return 1;
+                    }
+                }
+                break;
+            case OPT_VIDEO_SAMPLE:
+                {
+                    std::string sample = optarg;
+                    if (sample == "frames") {
+                        video_options.sampling = VideoSampling::Frames;
+                    } else if (sample == "keyframes") {
+                        video_options.sampling = VideoSampling::Keyframes;
+                    } else {
+                        char* end = nullptr;
+                        double interval = std::strtod(optarg, &end);
+                        if (end == optarg || *end != '\0' || !(interval > 0)) {
+                            std::cerr << "Video sampling must be frames, keyframes or a positive number of seconds" << std::endl;
+                            return 1;
+                        }
+                        video_options.sampling = VideoSampling::Interval;
+                        video_options.interval = interval;
+                    }
+                    video_sample_set = true;
+                }
+                break;
+            case OPT_DECODE_THREADS:
+                decode_threads = std::atoi(optarg);
+                if (decode_threads <= 0) {
+                    std::cerr << "Number of decode threads must be positive" << std::endl;
+                    return 1;
+                }
+                break;
+            case OPT_SHARD:
+                {
+                    char extra;
+                    if (std::sscanf(optarg, "%zu/%zu%c", &shard, &shards, &extra) != 2 || shard < 1 || shard > shards) {
+                        std::cerr << "Shard must be i/N with 1 <= i <= N" << std::endl;
+                        return 1;
+                    }
+                }
+                break;
+            case OPT_MERGE:
+                merge = true;
+                break;
+            case OPT_READAHEAD:
+                {
+                    int files = std::atoi(optarg);
+                    if (files < 0) {
+                        std::cerr << "Readahead must be 0 (off) or a positive number of files" << std::endl;
+                        return 1;
+                    }
+                    readahead_files = files;
+                }
+                break;
+            case OPT_READAHEAD_MB:
+                {
+                    int mib = std::atoi(optarg);
+                    if (mib <= 0) {
+                        std::cerr << "Readahead limit must be a positive number of MiB" << std::endl;
+                        return 1;
+                    }
+                    readahead_mib = mib;
+                }
+                break;
+            case OPT_COMPACT:
+                compact = true;
+                break;
+            case OPT_RELOCATE:
+                {
+                    const char* equals = std::strchr(optarg, '=');
+                    if (!equals || equals == optarg) {
+                        std::cerr << "Relocation must be old_prefix=new_prefix" << std::endl;
+                        return 1;
+                    }
+                    relocations.push_back({std::string(optarg, equals - optarg), std::string(equals + 1)});
+                }
+                break;
+            case OPT_PRUNE:
+                prune = true;
+                break;
+            case OPT_CONVERT:
+                convert_target = optarg;
+                break;
+            case OPT_DB_FORMAT:
+                {
+                    std::string format = optarg;
+                    if (format == "text") {
+                        db_format = DbFormat::Text;
+                    } else if (format == "binary") {
+                        db_format = DbFormat::Binary;
+                    } else {
+                        std::cerr << "Database format must be one of: text, binary" << std::endl;
+                        return 1;
+                    }
+                    db_format_set = true;
+                }
+                break;
             case '?':
-                std::cerr << "Usage: " << argv[0] << " [-d threshold] [-s source_file] [-w] [-g] [-j jobs] [-i|-v] [-r directory] [-t extension] [files...]" << std::endl;
+                std::cerr << "Usage: " << argv[0] << " [-d threshold] [-s source_file] [-w] [-g] [-j jobs] [-i|-v] [-r directory] [-t extension] [-q] [--search mode] [--convert target] [--db-format format] [--prune] [--compact [--relocate old=new]] [--top-k K] [--output format] [--subclip] [--new-only] [--cluster] [--file-timeout seconds] [--retry-failed] [--checkpoint-every N] [--checkpoint-interval seconds] [--serve socket] [--client socket [--request type]] [--stats] [--stats-json file] [--hash-copies] [--image-hash decode] [--video-hash backend] [--video-sample mode] [--decode-threads N] [--readahead N] [--readahead-mb MiB] [--shard i/N] [--merge] [files...]" << std::endl;
                 std::cerr << "  -d threshold: only show files with distance <= threshold" << std::endl;
                 std::cerr << "  -s source_file: load existing hashes from file" << std::endl;
                 std::cerr << "  -w: write new hashes to source file" << std::endl;
                 std::cerr << "  -g: generate hashes only (no comparison, implies -w)" << std::endl;
-                std::cerr << "  -j jobs: number of parallel jobs (default: 1)" << std::endl;
+                std::cerr << "  -j jobs: number of parallel jobs, or auto to adapt to the CPU limit and throughput (default: 1)" << std::endl;
                 std::cerr << "  -i: image hash mode" << std::endl;
                 std::cerr << "  -v: video hash mode" << std::endl;
                 std::cerr << "  -r directory: recursively search directory for files" << std::endl;
                 std::cerr << "  -t extension: filter by file extension (can be used multiple times)" << std::endl;
+                std::cerr << "  -q, --quiet: no per-file progress lines" << std::endl;
+                std::cerr << "  --search mode: pair search for -d: auto, brute or index (default: auto)" << std::endl;
+                std::cerr << "  --convert target: convert the -s database to target and exit" << std::endl;
+                std::cerr << "  --db-format format: text or binary, for --convert and new databases (default: text)" << std::endl;
+                std::cerr << "  --prune: drop database entries for files that no longer exist and exit" << std::endl;
+                std::cerr << "  --compact: rewrite the -s database with one entry per file, sorted, and exit" << std::endl;
+                std::cerr << "  --relocate old=new: with --compact, move paths under old to new (can be used multiple times)" << std::endl;
+                std::cerr << "  --top-k K: print at most K closest matches per file" << std::endl;
+                std::cerr << "  --output format: text or ndjson (default: text)" << std::endl;
+                std::cerr << "  --subclip: video mode, find the best alignment of the shorter video inside the longer one" << std::endl;
+                std::cerr << "  --new-only: compare only the given files, against each other and the database" << std::endl;
+                std::cerr << "  --cluster: with -d, print groups of duplicates instead of pairs" << std::endl;
+                std::cerr << "  --file-timeout seconds: give up on a file that takes longer than this to hash" << std::endl;
+                std::cerr << "  --retry-failed: hash files again that failed or timed out in earlier runs" << std::endl;
+                std::cerr << "  --checkpoint-every N: with -w/-g, save computed hashes every N files (default: 1000, 0: off)" << std::endl;
+                std::cerr << "  --checkpoint-interval seconds: with -w/-g, save computed hashes this often (default: 60, 0: off)" << std::endl;
+                std::cerr << "  --serve socket: keep the -s database in memory and answer requests on a Unix socket" << std::endl;
+                std::cerr << "  --client socket: send the given files to a --serve server" << std::endl;
+                std::cerr << "  --request type: client request: query, hash or insert (default: query)" << std::endl;
+                std::cerr << "  --stats: print per-stage timings, throughput and peak memory at the end" << std::endl;
+                std::cerr << "  --stats-json file: write the same statistics as JSON to file ('-' for stderr)" << std::endl;
+                std::cerr << "  --hash-copies: hash and compare byte-identical files separately instead of reusing one hash" << std::endl;
+                std::cerr << "  --image-hash decode: phash or scaled (JPEG/PNG/TIFF decoded at reduced size) (default: phash)" << std::endl;
+                std::cerr << "  --video-hash backend: phash or native (FFmpeg decode in process) (default: phash)" << std::endl;
+                std::cerr << "  --video-sample mode: native video frames to hash: frames, keyframes or seconds between samples (default: frames)" << std::endl;
+                std::cerr << "  --decode-threads N: native video decoder threads per file (default: cores / jobs)" << std::endl;
+                std::cerr << "  --readahead N: prefetch up to N files ahead of the hash workers, taking files in disk order (default: 0, off)" << std::endl;
+                std::cerr << "  --readahead-mb MiB: with --readahead, limit on prefetched data not yet hashed (default: 256)" << std::endl;
+                std::cerr << "  --shard i/N: compare only part i of N of the -s database's pairs, written as a partial file for --merge" << std::endl;
+                std::cerr << "  --merge: combine the given --shard partial files of the -s database into the usual output" << std::endl;
                 std::cerr << "  Note: Either -i (image) or -v (video) mode must be specified" << std::endl;
                 std::cerr << "  Use '-' as a file argument to read file list from stdin" << std::endl;
                 std::cerr << "  If no files provided and no -r specified, compare existing hashes in database" << std::endl;
                 return 1;
             default:
-                std::cerr << "Usage: " << argv[0] << " [-d threshold] [-s source_file] [-w] [-g] [-j jobs] [-i|-v] [-r directory] [-t extension] [files...]" << std::endl;
+                std::cerr << "Usage: " << argv[0] << " [-d threshold] [-s source_file] [-w] [-g] [-j jobs] [-i|-v] [-r directory] [-t extension] [-q] [--search mode] [--convert target] [--db-format format] [--prune] [--compact [--relocate old=new]] [--top-k K] [--output format] [--subclip] [--new-only] [--cluster] [--file-timeout seconds] [--retry-failed] [--checkpoint-every N] [--checkpoint-interval seconds] [--serve socket] [--client socket [--request type]] [--stats] [--stats-json file] [--hash-copies] [--image-hash decode] [--video-hash backend] [--video-sample mode] [--decode-threads N] [--readahead N] [--readahead-mb MiB] [--shard i/N] [--merge] [files...]" << std::endl;
                 return 1;
         }
     }
 
+    // -j auto plans for the CPUs the container actually grants; hashing
+    // adapts its worker count from there
+    CpuLimit cpu_limit;
+    if (auto_jobs) {
+        cpu_limit = detect_cpu_limit();
+        num_jobs = cpu_limit.cores;
+    }
+
+    // Database maintenance does not need a hash mode
+    if (prune) {
+        if (source_file.empty()) {
+            std::cerr << "Error: --prune needs a source database (-s)" << std::endl;
+            return 1;
+        }
+        return prune_database(source_file) ? 0 : 1;
+    }
+    if (!relocations.empty() && !compact) {
+        std::cerr << "Error: --relocate requires --compact" << std::endl;
+        return 1;
+    }
+    if (compact) {
+        if (source_file.empty()) {
+            std::cerr << "Error: --compact needs a source database (-s)" << std::endl;
+            return 1;
+        }
+        return compact_database(source_file, relocations) ? 0 : 1;
+    }
+    if (!convert_target.empty()) {
+        if (source_file.empty()) {
+            std::cerr << "Error: --convert needs a source database (-s)" << std::endl;
+            return 1;
+        }
+        if (!db_format_set) {
+            // Default to the other format than the one we read
+            db_format = is_binary_database(source_file) ? DbFormat::Text : DbFormat::Binary;
+        }
+        return convert_database(source_file, convert_target, db_format) ? 0 : 1;
+    }
+
+    CompareOptions compare_options;
+    compare_options.threshold = threshold;
+    compare_options.search_mode = search_mode;
+    compare_options.num_jobs = num_jobs;
+    compare_options.top_k = top_k;
+    compare_options.subclip = subclip;
+    compare_options.cluster = cluster;
+    ResultWriter writer(output_format);
+
+    // The client only talks to a server, which has its own mode and database
+    if (!client_socket.empty()) {
+        std::vector<std::string> files;
+        for (int i = optind; i < argc; ++i) {
+            if (std::string(argv[i]) == "-") {
+                read_files_from_stdin([&](const std::string& file) { files.push_back(file); });
+            } else {
+                files.push_back(argv[i]);
+            }
+        }
+        if (files.empty()) {
+            std::cerr << "Error: --client needs files to send" << std::endl;
+            return 1;
+        }
+        return run_client(client_socket, client_request, threshold, files, writer);
+    }
+
+    // Merging only needs the database's paths and hashes; the comparison
+    // options come from the partial files
+    if (merge) {
+        if (source_file.empty()) {
+            std::cerr << "Error: --merge needs the database the shards compared (-s)" << std::endl;
+            return 1;
+        }
+        if (shards > 0 || threshold >= 0 || top_k > 0 || subclip) {
+            std::cerr << "Error: --shard, -d, --top-k and --subclip go with the shard runs, not --merge" << std::endl;
+            return 1;
+        }
+        if (optind >= argc) {
+            std::cerr << "Error: --merge needs the shard files to combine" << std::endl;
+            return 1;
+        }
+        HashStore existing_hashes = load_hashes(source_file);
+        std::cerr << "Loaded " << existing_hashes.path_count() << " hashes from " << source_file << std::endl;
+        return merge_shards(existing_hashes, std::vector<std::string>(argv + optind, argv + argc), compare_options, writer);
+    }
+
     // Check that exactly one mode is specified
     if (!image_mode && !video_mode) {
         std::cerr << "Error: Must specify either -i (image mode) or -v (video mode)" << std::endl;
@@ -351,6 +5131,71 @@ int main(int argc, char* argv[]) {
         std::cerr << "Error: Cannot specify both -i (image mode) and -v (video mode)" << std::endl;
         return 1;
     }
+    if (subclip && !video_mode) {
+        std::cerr << "Error: --subclip requires -v (video mode)" << std::endl;
+        return 1;
+    }
+    if (cluster && threshold < 0) {
+        std::cerr << "Error: --cluster requires a threshold (-d)" << std::endl;
+        return 1;
+    }
+    // A row cut to its best matches would leave the rest out of the groups
+    if (cluster && top_k > 0) {
+        std::cerr << "Error: --cluster cannot be combined with --top-k" << std::endl;
+        return 1;
+    }
+
+    if (scaled_images && !image_mode) {
+        std::cerr << "Error: --image-hash scaled requires -i (image mode)" << std::endl;
+        return 1;
+    }
+#ifndef PHASH_COMPARE_SCALED_IMAGES
+    if (scaled_images) {
+        std::cerr << "Error: --image-hash scaled is not available: built without libjpeg, libpng or libtiff" << std::endl;
+        return 1;
+    }
+#endif
+    if (video_options.native && !video_mode) {
+        std::cerr << "Error: --video-hash native requires -v (video mode)" << std::endl;
+        return 1;
+    }
+    if (video_sample_set && !video_options.native) {
+        std::cerr << "Error: --video-sample requires --video-hash native" << std::endl;
+        return 1;
+    }
+#ifndef PHASH_COMPARE_NATIVE_VIDEO
+    if (video_options.native) {
+        std::cerr << "Error: --video-hash native is not available: built without FFmpeg headers" << std::endl;
+        return 1;
+    }
+#endif
+    // Share the cores between the files being decoded at once
+    if (decode_threads == 0) {
+        decode_threads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()) / num_jobs);
+    }
+    video_options.decode_threads = decode_threads;
+
+    HashWorkerOptions worker_options;
+    worker_options.file_timeout = file_timeout;
+    worker_options.self_exe = "/proc/self/exe";
+    worker_options.quiet = quiet;
+    worker_options.scaled_images = scaled_images;
+    worker_options.video = video_options;
+
+    if (!hash_one.empty()) {
+        return hash_one_file(hash_one, image_mode, worker_options);
+    }
+
+    if (!serve_socket.empty()) {
+        if (source_file.empty()) {
+            std::cerr << "Error: --serve needs a database (-s)" << std::endl;
+            return 1;
+        }
+        HashStore existing_hashes = load_hashes(source_file);
+        std::cerr << "Loaded " << existing_hashes.path_count() << " hashes from " << source_file << std::endl;
+        HashServer server(std::move(existing_hashes), source_file, db_format, image_mode, compare_options, worker_options);
+        return run_server(server, serve_socket, num_jobs);
+    }
 
     // Early exit if -g specified without source file
     if (generate_only && source_file.empty()) {
@@ -358,249 +5203,444 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    // Collect input files
-    std::vector<std::string> input_files;
-    
-    // Add files from command line arguments
-    for (int i = optind; i < argc; ++i) {
-        if (std::string(argv[i]) == "-") {
-            // Special case: read from stdin
-            std::cerr << "Reading file list from stdin..." << std::endl;
-            auto stdin_files = read_files_from_stdin();
-            input_files.insert(input_files.end(), stdin_files.begin(), stdin_files.end());
-        } else {
-            input_files.push_back(argv[i]);
+    // Statistics for --stats / --stats-json, reported when a run finishes
+    RunStats run_stats;
+    auto report_stats = [&]() {
+        run_stats.output = writer.output_time();
+        run_stats.output_bytes = writer.output_bytes();
+        if (show_stats) {
+            print_stats(run_stats);
+        }
+        if (stats_json == "-") {
+            std::cerr << format_stats_json(run_stats);
+        } else if (!stats_json.empty()) {
+            std::ofstream file(stats_json);
+            file << format_stats_json(run_stats);
+            if (!file) {
+                std::cerr << "Warning: Could not write statistics to " << stats_json << std::endl;
+            }
+        }
+    };
+    // Results are written while the comparison runs; that time is counted
+    // as output rather than compare
+    auto timed_compare = [&](const HashStore& store, const std::vector<HashStore::Id>& ids,
+                             const IdenticalCopies& identical = IdenticalCopies()) {
+        StageTime total;
+        StageTime output_before = writer.output_time();
+        {
+            StageClock clock(total);
+            run_stats.pairs = compare_hashes(store, ids, compare_options, writer, identical);
         }
+        run_stats.compare.wall += total.wall - (writer.output_time().wall - output_before.wall);
+        run_stats.compare.cpu += total.cpu - (writer.output_time().cpu - output_before.cpu);
+    };
+
+    bool have_inputs = optind < argc || !recursive_dirs.empty();
+    if (new_only && !have_inputs) {
+        std::cerr << "Error: --new-only needs input files to compare against the database" << std::endl;
+        return 1;
     }
-    
-    // Add files from recursive directory search
-    if (!recursive_dirs.empty()) {
-        auto recursive_files = find_files_recursive(recursive_dirs, file_types);
-        input_files.insert(input_files.end(), recursive_files.begin(), recursive_files.end());
+    if (shards > 0 && (have_inputs || source_file.empty())) {
+        std::cerr << "Error: --shard compares a database (-s) without input files" << std::endl;
+        return 1;
+    }
+    if (shards > 0 && cluster) {
+        std::cerr << "Error: --cluster goes with --merge, not --shard" << std::endl;
+        return 1;
     }
     
     // If no files specified anywhere and we have a source file, just compare existing hashes
-    if (input_files.empty() && !source_file.empty()) {
+    if (!have_inputs && !source_file.empty()) {
         std::cerr << "No input files specified, comparing existing hashes in database..." << std::endl;
         
         // Load existing hashes
-        std::map<std::string, std::pair<ulong64*, int>> existing_hashes = load_hashes(source_file);
-        if (existing_hashes.empty()) {
+        StageClock load_clock(run_stats.load);
+        HashStore existing_hashes = load_hashes(source_file);
+        load_clock.stop();
+        run_stats.entries_loaded = existing_hashes.path_count();
+        if (existing_hashes.path_count() == 0) {
             std::cerr << "Error: No hashes found in database " << source_file << std::endl;
             return 1;
         }
         
-        std::cerr << "Loaded " << existing_hashes.size() << " hashes from " << source_file << std::endl;
-        
-        // Convert to vector for comparison
-        std::vector<VideoHash> hashes;
-        for (const auto& pair : existing_hashes) {
-            hashes.emplace_back(pair.first, pair.second.first, pair.second.second);
-        }
-        
-        // Compare all pairs and group by first file
-        std::map<std::string, std::vector<std::pair<int, std::string>>> grouped_results;
-        std::set<std::pair<std::string, std::string>> reported;
+        std::cerr << "Loaded " << existing_hashes.path_count() << " hashes from " << source_file << std::endl;
         
-        for (size_t i = 0; i < hashes.size(); ++i) {
-            for (size_t j = i + 1; j < hashes.size(); ++j) {
-                int dist = hamming_distance(hashes[i].hash, hashes[i].length, hashes[j].hash, hashes[j].length);
-                if (threshold == -1 || dist <= threshold) {
-                    // Group by first filename and store distance with second filename
-                    grouped_results[hashes[i].filename].push_back({dist, hashes[j].filename});
-                    reported.insert({hashes[i].filename, hashes[j].filename});
-                }
-            }
-        }
-
-        // Print grouped and sorted results
-        for (const auto& group : grouped_results) {
-            const std::string& first_file = group.first;
-            const auto& comparisons = group.second;
-            
-            // Sort comparisons by distance (ascending)
-            std::vector<std::pair<int, std::string>> sorted_comparisons = comparisons;
-            std::sort(sorted_comparisons.begin(), sorted_comparisons.end());
-            
-            // Print all comparisons for this first file
-            for (const auto& comp : sorted_comparisons) {
-                std::cout << comp.first << " - " << first_file << " - " << comp.second << std::endl;
-            }
+        // Compare all pairs and stream them grouped by first file, or one
+        // shard's rows into a partial file
+        std::vector<HashStore::Id> ids = existing_hashes.current_entries();
+        if (shards > 0) {
+            ShardHeader header;
+            header.shard = compare_options.shard = shard;
+            header.shards = compare_options.shards = shards;
+            header.entries = ids.size();
+            std::tie(header.row_begin, header.row_end) = shard_rows(ids.size(), shard, shards);
+            header.threshold = threshold;
+            header.top_k = top_k;
+            header.subclip = subclip;
+            header.fingerprint = hash_set_fingerprint(existing_hashes, ids);
+            writer.shard_header(header);
         }
+        timed_compare(existing_hashes, ids);
+        report_stats();
         
         return 0;
     }
     
-    if (input_files.empty()) {
+    if (!have_inputs) {
         std::cerr << "Error: No input files specified" << std::endl;
         return 1;
     }
-    
-    std::cerr << "Found " << input_files.size() << " files to process" << std::endl;
 
-    // Load existing hashes if source file provided
-    std::map<std::string, std::pair<ulong64*, int>> existing_hashes;
+    // Load existing hashes if source file provided. The store ends up with
+    // every hash of the run: the database's, then moved files' aliases,
+    // then the newly computed ones
+    HashStore store;
     if (!source_file.empty()) {
-        existing_hashes = load_hashes(source_file);
-        std::cerr << "Loaded " << existing_hashes.size() << " existing hashes from " << source_file << std::endl;
+        StageClock load_clock(run_stats.load);
+        store = load_hashes(source_file);
+        load_clock.stop();
+        run_stats.entries_loaded = store.path_count();
+        std::cerr << "Loaded " << store.path_count() << " existing hashes from " << source_file << std::endl;
     }
 
-    std::vector<VideoHash> hashes;
-    
-    // Collect files that need hash computation
-    std::vector<std::string> files_to_process;
-    for (const auto& file : input_files) {
-        auto it = existing_hashes.find(file);
-        if (it != existing_hashes.end()) {
-            hashes.emplace_back(file, it->second.first, it->second.second);
+    // Index entries with known metadata by file identity, to recognise
+    // files that were renamed or moved since they were hashed
+    std::map<std::tuple<uint64_t, uint64_t, uint64_t>, HashStore::Id> by_identity;
+    for (HashStore::Id id = 0; id < store.size(); ++id) {
+        const FileMeta& meta = store.meta(id);
+        if (meta.known() && store.is_current(id)) {
+            by_identity[std::make_tuple(meta.dev, meta.ino, meta.size)] = id;
+        }
+    }
+
+    std::vector<HashStore::Id> run_ids;   // entries of this run's files
+    std::vector<HashStore::Id> moved_ids; // hash reused from another path
+    std::vector<std::string> moved_from;  // old paths of those, gone now
+
+    // Byte-identical copies of a file earlier in the run wait for its hash
+    // instead of being hashed themselves
+    struct IdenticalFile {
+        std::string file;
+        std::string source;
+        FileMeta meta;
+    };
+    IdenticalFileFinder identical_finder;
+    std::vector<IdenticalFile> identical_files;
+    std::map<std::string, FileMeta> input_meta;
+    size_t input_count = 0;
+    size_t queued_count = 0;
+    size_t skipped_count = 0;
+
+    // Files that failed or timed out before stay skipped until they change
+    std::map<std::string, std::pair<FileMeta, std::string>> previously_failed;
+    if (!source_file.empty() && !retry_failed) {
+        previously_failed = load_failure_list(failure_list_path(source_file));
+    }
+
+    // Hash workers start before the input is scanned and consume files
+    // while the scan is still producing them, largest queued file first
+    HashJobQueue work_queue(HASH_QUEUE_CAPACITY);
+    ThreadSafeVector<VideoHash> thread_results;
+    ThreadSafeVector<FailedFile> thread_failures;
+    HashStats hash_stats;
+    std::mutex cerr_mutex;
+    std::vector<std::thread> threads;
+    double hash_started = wall_seconds();
+    // With --readahead the workers take files from the readahead stage,
+    // which takes them from work_queue in disk order
+    ReadaheadStage readahead(work_queue, readahead_files, readahead_mib << 20);
+    if (readahead_files > 0) {
+        readahead.start();
+    }
+    HashJobQueue& worker_queue = readahead_files > 0 ? readahead.queue() : work_queue;
+    size_t located_by_extent = 0;
+    double children_cpu_before = process_cpu_seconds(RUSAGE_CHILDREN);
+    // With -j auto twice as many workers as cores are started, so waiting
+    // on I/O can be made up for, and the controller picks how many run
+    size_t hash_workers = auto_jobs ? 2 * static_cast<size_t>(num_jobs) : static_cast<size_t>(num_jobs);
+    ConcurrencyController concurrency(hash_workers);
+    if (auto_jobs) {
+        concurrency.start(num_jobs);
+        std::cerr << "Adaptive concurrency: " << cpu_limit.available << " cores available";
+        if (cpu_limit.quota > 0) {
+            std::cerr << ", cgroup quota " << cpu_limit.quota << " cores";
+        }
+        std::cerr << "; starting " << num_jobs << " of " << hash_workers << " hash workers" << std::endl;
+    }
+    for (size_t i = 0; i < hash_workers; ++i) {
+        threads.emplace_back(hash_worker, std::ref(worker_queue), std::ref(thread_results), std::ref(thread_failures),
+                             std::cref(worker_options), image_mode, std::ref(hash_stats), std::ref(cerr_mutex),
+                             std::ref(readahead), std::ref(concurrency), i);
+    }
+
+    // Save hashes as they are computed, so an interrupted run can resume
+    CheckpointWriter checkpoint(source_file, db_format, thread_results, checkpoint_every, checkpoint_interval,
+                                cerr_mutex);
+    if (write_hashes && !source_file.empty() && (checkpoint_every > 0 || checkpoint_interval > 0)) {
+        checkpoint.start();
+    }
+
+    // Producer stage: look each input up in the cache and queue only the
+    // files that need hashing. A cached hash is trusted while the file's
+    // size, mtime and inode still match what was recorded.
+    auto ingest = [&](const std::string& file) {
+        // A path given twice is one file, not a copy of itself
+        if (input_meta.count(file)) return;
+        ++input_count;
+        FileMeta meta = stat_file_meta(file);
+        input_meta[file] = meta;
+
+        HashStore::Id cached = store.find(file);
+        if (cached != HashStore::NONE && (!store.meta(cached).known() || store.meta(cached) == meta)) {
+            run_ids.push_back(cached);
+            if (!hash_copies) identical_finder.add(file, meta.size);
+            if (quiet) return;
+            std::lock_guard<std::mutex> lock(cerr_mutex);
             std::cerr << "Loaded hash for " << file << std::endl;
-        } else {
-            files_to_process.push_back(file);
-        }
-    }
-
-    // Process files that need hash computation (with multithreading if requested)
-    if (!files_to_process.empty()) {
-        if (num_jobs > 1 && files_to_process.size() > 1) {
-            // Multi-threaded processing
-            std::cerr << "Processing " << files_to_process.size() << " files with " << num_jobs << " threads..." << std::endl;
-            
-            ThreadSafeQueue<std::string> work_queue;
-            ThreadSafeVector<VideoHash> thread_results;
-            std::mutex cerr_mutex;
-            
-            // Add work to queue
-            for (const auto& file : files_to_process) {
-                work_queue.push(file);
-            }
-            
-            // Start worker threads
-            std::vector<std::thread> threads;
-            for (int i = 0; i < num_jobs; ++i) {
-                if (image_mode) {
-                    threads.emplace_back(image_hash_worker, std::ref(work_queue), std::ref(thread_results), std::ref(cerr_mutex));
-                } else {
-                    threads.emplace_back(video_hash_worker, std::ref(work_queue), std::ref(thread_results), std::ref(cerr_mutex));
+            return;
+        }
+        if (cached != HashStore::NONE && !quiet) {
+            std::lock_guard<std::mutex> lock(cerr_mutex);
+            std::cerr << "File changed since it was hashed: " << file << std::endl;
+        } else if (cached == HashStore::NONE && meta.known()) {
+            auto moved = by_identity.find(std::make_tuple(meta.dev, meta.ino, meta.size));
+            if (moved != by_identity.end() && store.meta(moved->second).mtime_ns == meta.mtime_ns) {
+                HashStore::Id id = store.alias(file, moved->second, meta);
+                run_ids.push_back(id);
+                moved_ids.push_back(id);
+                if (!hash_copies) identical_finder.add(file, meta.size);
+                // The old path is not compared, unless it is another link
+                // to the file
+                std::string old_path(store.path(moved->second));
+                if (file_missing(old_path)) {
+                    store.forget(moved->second);
+                    moved->second = id;
+                    moved_from.push_back(old_path);
                 }
+                if (quiet) return;
+                std::lock_guard<std::mutex> lock(cerr_mutex);
+                std::cerr << "Reused hash of " << old_path << " for moved file " << file << std::endl;
+                return;
             }
-            
-            // Wait for all threads to complete
-            for (auto& thread : threads) {
-                thread.join();
+        }
+        auto failed = previously_failed.find(file);
+        if (failed != previously_failed.end() && failed->second.first == meta) {
+            ++skipped_count;
+            if (quiet) return;
+            std::lock_guard<std::mutex> lock(cerr_mutex);
+            std::cerr << "Skipping previously failed file " << file << " (" << failed->second.second << ")" << std::endl;
+            return;
+        }
+        if (!hash_copies) {
+            if (const std::string* source = identical_finder.match(file, meta.size)) {
+                identical_files.push_back({file, *source, meta});
+                if (quiet) return;
+                std::lock_guard<std::mutex> lock(cerr_mutex);
+                std::cerr << "Identical to " << identical_files.back().source << ", not hashing " << file << std::endl;
+                return;
+            }
+        }
+        ++queued_count;
+        HashJob job{file, meta};
+        if (readahead_files > 0) {
+            bool by_extent;
+            job.by_location = true;
+            job.location = file_location(file, meta, by_extent);
+            if (by_extent) ++located_by_extent;
+        }
+        work_queue.push(std::move(job));
+    };
+
+    // Add files from command line arguments
+    StageClock scan_clock(run_stats.scan, true);
+    for (int i = optind; i < argc; ++i) {
+        if (std::string(argv[i]) == "-") {
+            // Special case: read from stdin
+            {
+                std::lock_guard<std::mutex> lock(cerr_mutex);
+                std::cerr << "Reading file list from stdin..." << std::endl;
             }
-            
-            // Collect results
-            auto thread_hashes = thread_results.get_all();
-            hashes.insert(hashes.end(), thread_hashes.begin(), thread_hashes.end());
-            
+            read_files_from_stdin(ingest);
         } else {
-            // Single-threaded processing
-            for (const auto& file : files_to_process) {
-                if (image_mode) {
-                    ulong64 hash;
-                    int result = ph_dct_imagehash(file.c_str(), hash);
-                    if (result != 0 || hash == 0) {
-                        std::cerr << "Failed to compute image hash for " << file << std::endl;
-                        continue;
-                    }
-                    ulong64* hash_array = (ulong64*)malloc(sizeof(ulong64));
-                    hash_array[0] = hash;
-                    hashes.emplace_back(file, hash_array, 1);
-                    std::cerr << "Computed image hash for " << file << std::endl;
-                } else {
-                    int length = 0;
-                    ulong64* hash = ph_dct_videohash(file.c_str(), length);
-                    if (!hash || length == 0) {
-                        std::cerr << "Failed to compute video hash for " << file << std::endl;
-                        continue;
-                    }
-                    hashes.emplace_back(file, hash, length);
-                    std::cerr << "Computed video hash for " << file << std::endl;
-                }
+            ingest(argv[i]);
+        }
+    }
+    
+    // Add files from recursive directory search
+    if (!recursive_dirs.empty()) {
+        find_files_recursive(recursive_dirs, file_types, ingest);
+    }
+    scan_clock.stop();
+
+    // No more input: workers drain the queue and exit
+    work_queue.close();
+    {
+        std::lock_guard<std::mutex> lock(cerr_mutex);
+        std::cerr << "Found " << input_count << " files, " << queued_count << " queued for hashing with "
+                  << (auto_jobs ? "up to " : "") << hash_workers << " threads";
+        if (skipped_count > 0) {
+            std::cerr << ", " << skipped_count << " skipped after earlier failures";
+        }
+        if (!identical_files.empty()) {
+            std::cerr << ", " << identical_files.size() << " identical to another file";
+        }
+        std::cerr << std::endl;
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    readahead.join();
+    if (readahead_files > 0) {
+        std::cerr << "Readahead: " << readahead.files_prefetched() << " files, "
+                  << readahead.bytes_prefetched() / (1 << 20) << " MiB prefetched in disk order ("
+                  << located_by_extent << " of " << queued_count << " placed by extent, the rest by inode)" << std::endl;
+    }
+    concurrency.stop();
+    run_stats.hash_workers = concurrency.settled();
+    if (auto_jobs) {
+        std::cerr << "Adaptive concurrency: settled on " << concurrency.settled() << " hash workers (tried "
+                  << concurrency.lowest_tried() << "-" << concurrency.highest_tried() << ")" << std::endl;
+    }
+    checkpoint.stop();
+    // Isolated hashing (--file-timeout) runs in child processes
+    run_stats.hash.wall = wall_seconds() - hash_started;
+    run_stats.hash.cpu = hash_stats.cpu + process_cpu_seconds(RUSAGE_CHILDREN) - children_cpu_before;
+    run_stats.hash_latency = hash_stats.latency;
+    run_stats.files_found = input_count;
+    run_stats.files_hashed = hash_stats.files;
+    run_stats.bytes_hashed = hash_stats.bytes;
+    run_stats.save += checkpoint.time();
+    
+    // Move the computed hashes into the store; the first checkpoint.saved()
+    // of them are already in the database
+    auto thread_hashes = thread_results.get_all();
+    std::vector<HashStore::Id> computed_ids;
+    computed_ids.reserve(thread_hashes.size());
+    for (auto& vh : thread_hashes) {
+        computed_ids.push_back(store.add(vh.filename, vh.hash, vh.length, vh.meta));
+        free(vh.hash);
+    }
+    thread_hashes.clear();
+    run_ids.insert(run_ids.end(), computed_ids.begin(), computed_ids.end());
+    auto failures = thread_failures.get_all();
+
+    // Copies share their source's hash, or its failure
+    IdenticalCopies identical_copies;
+    std::vector<HashStore::Id> copy_ids;
+    if (!identical_files.empty()) {
+        std::unordered_map<std::string, std::string> failed_sources;
+        for (const auto& failure : failures) {
+            failed_sources[failure.filename] = failure.reason;
+        }
+        for (const auto& copy : identical_files) {
+            auto failed = failed_sources.find(copy.source);
+            if (failed != failed_sources.end()) {
+                failures.push_back({copy.file, failed->second});
+                continue;
             }
+            HashStore::Id source = store.find(copy.source);
+            HashStore::Id id = store.alias(copy.file, source, copy.meta);
+            run_ids.push_back(id);
+            copy_ids.push_back(id);
+            identical_copies[source].push_back(id);
+        }
+        identical_files.clear();
+
+        // Each group is compared through the path that sorts first, so the
+        // rows of its copies come after that path's row
+        IdenticalCopies by_first;
+        for (auto& group : identical_copies) {
+            std::vector<HashStore::Id> members = std::move(group.second);
+            members.push_back(group.first);
+            store.sort_by_path(members);
+            by_first[members.front()].assign(members.begin() + 1, members.end());
+        }
+        identical_copies = std::move(by_first);
+    }
+    run_stats.files_identical = copy_ids.size();
+    run_stats.files_failed = failures.size();
+    if (!failures.empty()) {
+        std::cerr << failures.size() << " files could not be hashed:" << std::endl;
+        for (const auto& failure : failures) {
+            std::cerr << "  " << failure.filename << " (" << failure.reason << ")" << std::endl;
+        }
+        if (write_hashes && !source_file.empty()) {
+            StageClock save_clock(run_stats.save);
+            save_failure_list(failure_list_path(source_file), failures, input_meta);
         }
     }
 
+    if (input_count == 0 && source_file.empty()) {
+        std::cerr << "Error: No input files specified" << std::endl;
+        return 1;
+    }
+
+    // Everything that is not already in the database as-is: moved files and
+    // computed hashes not yet checkpointed, with the metadata they were
+    // taken against
+    std::vector<HashStore::Id> new_ids = moved_ids;
+    new_ids.insert(new_ids.end(), copy_ids.begin(), copy_ids.end());
+    new_ids.insert(new_ids.end(), computed_ids.begin() + checkpoint.saved(), computed_ids.end());
+
     // If generate-only mode, just save hashes and exit
     if (generate_only) {
-        // Only save hashes for files that were newly computed (not loaded from database)
-        std::vector<VideoHash> new_hashes;
-        for (const auto& vh : hashes) {
-            if (existing_hashes.find(vh.filename) == existing_hashes.end()) {
-                new_hashes.push_back(vh);
-            }
-        }
-        
-        if (!new_hashes.empty()) {
-            save_hashes(source_file, new_hashes);
-            std::cerr << "Saved " << new_hashes.size() << " new hashes to " << source_file << std::endl;
+        if (!new_ids.empty() || checkpoint.saved() > 0) {
+            // Also folds a binary database's checkpoint journal back in
+            StageClock save_clock(run_stats.save);
+            save_hashes(source_file, store, new_ids, db_format, moved_from);
+            save_clock.stop();
+            std::cerr << "Saved " << new_ids.size() + checkpoint.saved() << " new hashes to " << source_file << std::endl;
         } else {
             std::cerr << "No new hashes to save (all files already in database)" << std::endl;
         }
-        
-        // Free hashes (only the ones we computed, not loaded ones)
-        for (auto& vh : hashes) {
-            if (existing_hashes.find(vh.filename) == existing_hashes.end()) {
-                free(vh.hash);
-            }
-        }
+        report_stats();
         return 0;
     }
 
-    // For comparison, we need to include all existing hashes from database
-    std::vector<VideoHash> all_hashes_for_comparison;
-    
-    // Add all existing hashes from database
-    for (const auto& pair : existing_hashes) {
-        all_hashes_for_comparison.emplace_back(pair.first, pair.second.first, pair.second.second);
+    // The current entry of every path is this run's hash where there is one
+    // and the database's otherwise. Identical copies are left out and
+    // reported with the first path of their group.
+    std::vector<char> is_copy(store.path_count(), 0);
+    for (const auto& group : identical_copies) {
+        for (HashStore::Id id : group.second) {
+            is_copy[store.path_id(id)] = 1;
+        }
     }
-    
-    // Add newly computed hashes
-    all_hashes_for_comparison.insert(all_hashes_for_comparison.end(), hashes.begin(), hashes.end());
-
-    // Compare all pairs and group by first file
-    std::map<std::string, std::vector<std::pair<int, std::string>>> grouped_results;
-    std::set<std::pair<std::string, std::string>> reported;
-    
-    for (size_t i = 0; i < all_hashes_for_comparison.size(); ++i) {
-        for (size_t j = i + 1; j < all_hashes_for_comparison.size(); ++j) {
-            int dist = hamming_distance(all_hashes_for_comparison[i].hash, all_hashes_for_comparison[i].length, 
-                                      all_hashes_for_comparison[j].hash, all_hashes_for_comparison[j].length);
-            if (threshold == -1 || dist <= threshold) {
-                // Group by first filename and store distance with second filename
-                grouped_results[all_hashes_for_comparison[i].filename].push_back({dist, all_hashes_for_comparison[j].filename});
-                reported.insert({all_hashes_for_comparison[i].filename, all_hashes_for_comparison[j].filename});
+    std::vector<HashStore::Id> compared;
+    if (new_only) {
+        // This run's files go first and only their rows are compared: against
+        // each other and against the database, never database against database
+        std::vector<char> in_run(store.path_count(), 0);
+        for (HashStore::Id id : run_ids) {
+            if (!in_run[store.path_id(id)]) {
+                in_run[store.path_id(id)] = 1;
+                if (!is_copy[store.path_id(id)]) compared.push_back(store.find(store.path(id)));
             }
         }
-    }
-
-    // Print grouped and sorted results
-    for (const auto& group : grouped_results) {
-        const std::string& first_file = group.first;
-        const auto& comparisons = group.second;
-        
-        // Sort comparisons by distance (ascending)
-        std::vector<std::pair<int, std::string>> sorted_comparisons = comparisons;
-        std::sort(sorted_comparisons.begin(), sorted_comparisons.end());
-        
-        // Print all comparisons for this first file
-        for (const auto& comp : sorted_comparisons) {
-            std::cout << comp.first << " - " << first_file << " - " << comp.second << std::endl;
+        store.sort_by_path(compared);
+        compare_options.rows = compared.size();
+        for (HashStore::Id id : store.current_entries()) {
+            if (!in_run[store.path_id(id)]) compared.push_back(id);
+        }
+    } else {
+        // Rows are written in order, so sorted by path to group output by file
+        for (HashStore::Id id : store.current_entries()) {
+            if (!is_copy[store.path_id(id)]) compared.push_back(id);
         }
     }
 
+    // Compare all pairs and stream them grouped by first file
+    timed_compare(store, compared, identical_copies);
+
     // Save new hashes if requested
-    if (write_hashes && !source_file.empty() && !files_to_process.empty()) {
-        save_hashes(source_file, hashes);
+    if (write_hashes && !source_file.empty() && (!new_ids.empty() || checkpoint.saved() > 0)) {
+        StageClock save_clock(run_stats.save);
+        save_hashes(source_file, store, new_ids, db_format, moved_from);
+        save_clock.stop();
         std::cerr << "Saved hashes to " << source_file << std::endl;
     }
 
-    // Free hashes (only the ones we computed, not loaded ones)
-    for (auto& vh : hashes) {
-        if (existing_hashes.find(vh.filename) == existing_hashes.end()) {
-            free(vh.hash);
-        }
-    }
-
+    report_stats();
     return 0;
-} 
\ No newline at end of file
+}
+#endif // PHASH_COMPARE_NO_MAIN
@@ -0,0 +1,82 @@
+#!/bin/bash
+# Byte-identical copies are hashed once, but the output must be the same as
+# a --hash-copies run, which hashes and compares every copy: the same pairs,
+# in the same rows and the same order.
+#
+# Usage: ./test_identical_copies.sh [path/to/phash-compare]
+
+set -e
+
+bin=${1:-./build/phash-compare}
+
+echo "=== Testing identical-file reporting ==="
+
+if [ ! -x "$bin" ]; then
+    echo "Error: $bin not found. Build the project first (./build.sh)."
+    exit 1
+fi
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# 64x64 plain PPM images, which pHash reads without any decoder library:
+# a gradient, the same gradient with one corner brightened (a near
+# duplicate) and a checkerboard
+ppm() {
+    awk -v pattern="$1" 'BEGIN {
+        print "P3"; print "64 64"; print "255"
+        for (y = 0; y < 64; y++) {
+            for (x = 0; x < 64; x++) {
+                if (pattern == "checker") {
+                    v = (int(x / 8) + int(y / 8)) % 2 ? 255 : 0
+                    print v, v, v
+                } else if (pattern == "near" && x < 8 && y < 8) {
+                    print 255, 255, 255
+                } else {
+                    print x * 4, y * 4, 128
+                }
+            }
+        }
+    }' > "$2"
+}
+ppm gradient "$dir/a.ppm"
+ppm near "$dir/near.ppm"
+ppm checker "$dir/other.ppm"
+# Copies on both sides of their source in path order
+cp "$dir/a.ppm" "$dir/0_copy.ppm"
+cp "$dir/a.ppm" "$dir/z_copy.ppm"
+
+# The source is the first copy seen, so its path does not sort first
+files="$dir/a.ppm $dir/near.ppm $dir/other.ppm $dir/0_copy.ppm $dir/z_copy.ppm"
+
+for args in "" "-d 10" "-d 64" "--top-k 1" "--top-k 2 -d 64"; do
+    with_prefilter=$("$bin" -i $args $files 2> /dev/null)
+    without_prefilter=$("$bin" -i $args --hash-copies $files 2> /dev/null)
+    if [ -n "$with_prefilter" ] && [ "$with_prefilter" == "$without_prefilter" ]; then
+        echo "✓ Same output as --hash-copies with options '$args'"
+    else
+        echo "✗ Output differs from --hash-copies with options '$args'"
+        diff <(echo "$with_prefilter") <(echo "$without_prefilter") || true
+        exit 1
+    fi
+done
+
+if "$bin" -i $files 2> /dev/null | grep -q "0_copy.ppm - .*near.ppm"; then
+    echo "✓ The copy is reported against the near-duplicate"
+else
+    echo "✗ The copy is missing its match with the near-duplicate"
+    exit 1
+fi
+
+once=$("$bin" -i "$dir/a.ppm" "$dir/near.ppm" 2> /dev/null)
+twice=$("$bin" -i "$dir/a.ppm" "$dir/near.ppm" "$dir/a.ppm" 2> /dev/null)
+if [ -n "$once" ] && [ "$once" == "$twice" ]; then
+    echo "✓ A path given twice is compared once"
+else
+    echo "✗ A path given twice changes the output"
+    echo "$twice"
+    exit 1
+fi
+
+echo ""
+echo "=== All tests passed! ==="